@@ -3,15 +3,19 @@
 #include <ctype.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <math.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/select.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
 #include "console.h"
+#include "eventlog.h"
 #include "report.h"
 #include "web.h"
 
@@ -20,6 +24,11 @@ int simulation = 0;
 int show_entropy = 0;
 static cmd_element_t *cmd_list = NULL;
 static param_element_t *param_list = NULL;
+
+/* Hash tables of commands and parameters by name, chained */
+#define HASH_SIZE 64
+static cmd_element_t *cmd_table[HASH_SIZE];
+static param_element_t *param_table[HASH_SIZE];
 static bool block_flag = false;
 static bool prompt_flag = true;
 
@@ -31,6 +40,7 @@ static double first_time, last_time;
 
 /* Implement buffered I/O using variant of RIO package from CS:APP
  * Must create stack of buffers to handle I/O with nested source commands.
+ * Regular files are mapped instead, and their lines are handed out in place.
  */
 
 #define RIO_BUFSIZE 8192
@@ -40,6 +50,10 @@ typedef struct __rio {
     int count;             /* Unread bytes in internal buffer */
     char *bufptr;          /* Next unread byte in internal buffer */
     char buf[RIO_BUFSIZE]; /* Internal buffer */
+    bool mapped;           /* Read from map rather than buf */
+    char *map;             /* Private, writable mapping of the file */
+    size_t map_len;
+    char *mapptr;          /* Next unread byte in the mapping */
     struct __rio *prev;    /* Next element in stack */
 } rio_t;
 
@@ -56,6 +70,8 @@ static int echo = 0;
 
 static bool quit_flag = false;
 static char *prompt = "cmd> ";
+static reset_func_t bench_reset = NULL;
+static int loop_depth = 0; /* of unclosed repeat blocks */
 static bool has_infile = false;
 
 /* Optional function to call as part of exit process */
@@ -71,6 +87,34 @@ static bool push_file(char *fname);
 static void pop_file();
 
 static bool interpret_cmda(int argc, char *argv[]);
+static bool subst_vars(int argc, char *argv[]);
+static bool loop_capture(int argc, char *argv[]);
+static bool loop_finish();
+
+/* FNV-1a, reduced to a bucket index */
+static unsigned hash_name(const char *name)
+{
+    uint32_t h = 2166136261u;
+    for (const unsigned char *s = (const unsigned char *) name; *s; s++)
+        h = (h ^ *s) * 16777619u;
+    return h & (HASH_SIZE - 1);
+}
+
+static cmd_element_t *find_cmd(const char *name)
+{
+    cmd_element_t *cmd = cmd_table[hash_name(name)];
+    while (cmd && strcmp(name, cmd->name))
+        cmd = cmd->hash_next;
+    return cmd;
+}
+
+static param_element_t *find_param(const char *name)
+{
+    param_element_t *param = param_table[hash_name(name)];
+    while (param && strcmp(name, param->name))
+        param = param->hash_next;
+    return param;
+}
 
 /* Add a new command */
 void add_cmd(char *name, cmd_func_t operation, char *summary, char *param)
@@ -87,8 +131,13 @@ void add_cmd(char *name, cmd_func_t operation, char *summary, char *param)
     cmd->operation = operation;
     cmd->summary = summary;
     cmd->param = param;
+    cmd->latency = NULL;
     cmd->next = next_cmd;
     *last_loc = cmd;
+
+    unsigned h = hash_name(name);
+    cmd->hash_next = cmd_table[h];
+    cmd_table[h] = cmd;
 }
 
 /* Add a new parameter */
@@ -109,51 +158,136 @@ void add_param(char *name, int *valp, char *summary, setter_func_t setter)
     param->setter = setter;
     param->next = next_param;
     *last_loc = param;
+
+    unsigned h = hash_name(name);
+    param->hash_next = param_table[h];
+    param_table[h] = param;
+}
+
+/* Memory of cmd_alloc: a stack of chunks from malloc_or_fail, so that it is
+ * counted like any other allocation of the interpreter.  It is emptied after
+ * each command line, and the chunks are merged into one big enough for the
+ * next line, so that a steady stream of commands does not call malloc.
+ */
+#define ARENA_CHUNK 4096
+#define ARENA_MAX (1 << 20) /* largest chunk kept between lines */
+
+typedef struct __arena_chunk {
+    struct __arena_chunk *prev;
+    size_t size; /* of data */
+    size_t used;
+    max_align_t data[];
+} arena_chunk_t;
+
+static arena_chunk_t *arena;
+
+static arena_chunk_t *arena_grow(size_t size)
+{
+    arena_chunk_t *c =
+        malloc_or_fail(sizeof(arena_chunk_t) + size, "cmd_alloc");
+    c->prev = arena;
+    c->size = size;
+    c->used = 0;
+    arena = c;
+    return c;
+}
+
+static void arena_free(arena_chunk_t *c)
+{
+    free_block(c, sizeof(arena_chunk_t) + c->size);
+}
+
+void *cmd_alloc(size_t bytes)
+{
+    bytes = (bytes + sizeof(max_align_t) - 1) & ~(sizeof(max_align_t) - 1);
+    arena_chunk_t *c = arena;
+    if (!c || c->size - c->used < bytes)
+        c = arena_grow(bytes > ARENA_CHUNK ? bytes : ARENA_CHUNK);
+    void *p = (char *) c->data + c->used;
+    c->used += bytes;
+    return p;
+}
+
+void cmd_mark(cmd_mark_t *mark)
+{
+    mark->chunk = arena;
+    mark->used = arena ? arena->used : 0;
+}
+
+void cmd_release(const cmd_mark_t *mark)
+{
+    while (arena != mark->chunk) {
+        arena_chunk_t *c = arena;
+        arena = c->prev;
+        arena_free(c);
+    }
+    if (arena)
+        arena->used = mark->used;
 }
 
-/* Parse a string into a command line */
+/* Empty the arena at the end of a command line */
+static void arena_reset()
+{
+    if (!arena)
+        return;
+    if (!arena->prev) {
+        arena->used = 0;
+        return;
+    }
+    size_t total = 0;
+    while (arena) {
+        arena_chunk_t *c = arena;
+        arena = c->prev;
+        total += c->size;
+        arena_free(c);
+    }
+    arena_grow(total < ARENA_MAX ? total : ARENA_MAX);
+}
+
+static void arena_destroy()
+{
+    cmd_mark_t empty = {NULL, 0};
+    cmd_release(&empty);
+}
+
+/* Parse a string into a command line.  The words are split in place, by
+ * putting a null character after each, and argv points into line.
+ */
 static char **parse_args(char *line, int *argcp)
 {
     /* Must first determine how many arguments there are.
      * Replace all white space with null characters
      */
-    size_t len = strlen(line);
-
-    /* First copy into buffer with each substring null-terminated */
-    char *buf = malloc_or_fail(len + 1, "parse_args");
-    buf[len] = '\0';
-
     char *src = line;
-    char *dst = buf;
     bool skipping = true;
     int c;
     int argc = 0;
-    while ((c = *src++) != '\0') {
+    while ((c = *src) != '\0') {
         if (isspace(c)) {
             if (!skipping) {
                 /* Hit end of word */
-                *dst++ = '\0';
                 skipping = true;
             }
-        } else {
-            if (skipping) {
-                /* Hit start of new word */
-                argc++;
-                skipping = false;
-            }
-            *dst++ = c;
+            *src = '\0';
+        } else if (skipping) {
+            /* Hit start of new word */
+            argc++;
+            skipping = false;
         }
+        src++;
     }
+    char *end = src;
 
     /* Now assemble into array of strings */
-    char **argv = calloc_or_fail(argc, sizeof(char *), "parse_args");
-    src = buf;
+    char **argv = cmd_alloc(argc * sizeof(char *));
+    src = line;
     for (int i = 0; i < argc; i++) {
-        argv[i] = strsave_or_fail(src, "parse_args");
-        src += strlen(argv[i]) + 1;
+        while (src < end && *src == '\0')
+            src++;
+        argv[i] = src;
+        src += strlen(src);
     }
 
-    free_block(buf, len + 1);
     *argcp = argc;
     return argv;
 }
@@ -167,29 +301,48 @@ static void record_error()
     }
 }
 
-/* Execute a command that has already been split into arguments */
-static bool interpret_cmda(int argc, char *argv[])
+static void record_latency(cmd_element_t *cmd, uint64_t ns)
+{
+    if (!cmd->latency) {
+        cmd->latency = malloc_or_fail(sizeof(histogram_t), "record_latency");
+        hist_reset(cmd->latency);
+    }
+    hist_add(cmd->latency, ns);
+}
+
+/* Run a command, or report that argv[0] names none when cmd is NULL */
+static bool run_cmd(cmd_element_t *next_cmd, int argc, char *argv[])
 {
-    if (argc == 0)
-        return true;
-    /* Try to find matching command */
-    cmd_element_t *next_cmd = cmd_list;
     bool ok = true;
-    while (next_cmd && strcmp(argv[0], next_cmd->name) != 0)
-        next_cmd = next_cmd->next;
+    eventlog_mark_t mark;
+    eventlog_begin(&mark);
     if (next_cmd) {
+        uint64_t start = time_ns();
         ok = next_cmd->operation(argc, argv);
+        uint64_t elapsed = time_ns() - start;
         if (!ok)
             record_error();
+        /* 'quit' frees the commands */
+        if (!quit_flag)
+            record_latency(next_cmd, elapsed);
     } else {
         report(1, "Unknown command '%s'", argv[0]);
         record_error();
         ok = false;
     }
+    eventlog_end(&mark, argc, argv, ok);
 
     return ok;
 }
 
+/* Execute a command that has already been split into arguments */
+static bool interpret_cmda(int argc, char *argv[])
+{
+    if (argc == 0)
+        return true;
+    return run_cmd(find_cmd(argv[0]), argc, argv);
+}
+
 /* Execute a command from a command line */
 static bool interpret_cmd(char *cmdline)
 {
@@ -198,10 +351,17 @@ static bool interpret_cmd(char *cmdline)
 
     int argc;
     char **argv = parse_args(cmdline, &argc);
-    bool ok = interpret_cmda(argc, argv);
-    for (int i = 0; i < argc; i++)
-        free_string(argv[i]);
-    free_array(argv, argc, sizeof(char *));
+    bool ok;
+    if (loop_depth)
+        ok = !loop_capture(argc, argv) || loop_finish();
+    else if (subst_vars(argc, argv))
+        ok = interpret_cmda(argc, argv);
+    else {
+        record_error();
+        ok = false;
+    }
+    arena_reset();
+    report_flush();
 
     return ok;
 }
@@ -215,6 +375,12 @@ void add_quit_helper(cmd_func_t qf)
         report_event(MSG_FATAL, "Exceeded limit on quit helpers");
 }
 
+/* Set function that puts the state back between runs of 'bench' */
+void set_bench_reset(reset_func_t rf)
+{
+    bench_reset = rf;
+}
+
 /* Turn echoing on/off */
 void set_echo(bool on)
 {
@@ -229,6 +395,8 @@ static bool do_quit(int argc, char *argv[])
     while (c) {
         cmd_element_t *ele = c;
         c = c->next;
+        if (ele->latency)
+            free_block(ele->latency, sizeof(histogram_t));
         free_block(ele, sizeof(cmd_element_t));
     }
 
@@ -238,9 +406,18 @@ static bool do_quit(int argc, char *argv[])
         p = p->next;
         free_block(ele, sizeof(param_element_t));
     }
+    cmd_list = NULL;
+    param_list = NULL;
+    memset(cmd_table, 0, sizeof(cmd_table));
+    memset(param_table, 0, sizeof(param_table));
 
-    while (buf_stack)
-        pop_file();
+    /* Close the input, which also ends linenoise.  The buffers stay until
+     * finish_cmd, as the line being run may lie in a mapped file.
+     */
+    for (rio_t *r = buf_stack; r; r = r->prev) {
+        close(r->fd);
+        r->fd = -1;
+    }
 
     for (int i = 0; i < quit_helper_cnt; i++) {
         ok = ok && quit_helpers[i](argc, argv);
@@ -311,7 +488,6 @@ static bool do_option(int argc, char *argv[])
     for (int i = 1; i < argc; i++) {
         char *name = argv[i];
         int value = 0;
-        bool found = false;
         /* Get value from next argument */
         if (i + 1 >= argc) {
             report(1, "No value given for parameter %s", name);
@@ -320,23 +496,15 @@ static bool do_option(int argc, char *argv[])
             report(1, "Cannot parse '%s' as integer", argv[i]);
             return false;
         }
-        /* Find parameter in list */
-        param_element_t *plist = param_list;
-        while (!found && plist) {
-            if (strcmp(plist->name, name) == 0) {
-                int oldval = *plist->valp;
-                *plist->valp = value;
-                if (plist->setter)
-                    plist->setter(oldval);
-                found = true;
-            } else
-                plist = plist->next;
-        }
-        /* Didn't find parameter */
-        if (!found) {
+        param_element_t *param = find_param(name);
+        if (!param) {
             report(1, "Unknown parameter '%s'", name);
             return false;
         }
+        int oldval = *param->valp;
+        *param->valp = value;
+        if (param->setter)
+            param->setter(oldval);
     }
 
     return true;
@@ -371,40 +539,914 @@ static bool do_log(int argc, char *argv[])
     return result;
 }
 
+static bool do_record(int argc, char *argv[])
+{
+    if (argc > 2) {
+        report(1, "%s takes at most one file name", argv[0]);
+        return false;
+    }
+
+    /* Without a file name, stop recording */
+    bool result = eventlog_open(argc == 2 ? argv[1] : NULL);
+    if (!result)
+        report(1, "Couldn't open event log '%s'", argv[1]);
+
+    return result;
+}
+
+/* Scale ns to a readable unit */
+static void format_ns(char *buf, size_t size, uint64_t ns)
+{
+    if (ns < 1000)
+        snprintf(buf, size, "%lu ns", (unsigned long) ns);
+    else if (ns < 1000000)
+        snprintf(buf, size, "%.1f us", ns / 1e3);
+    else if (ns < 1000000000)
+        snprintf(buf, size, "%.1f ms", ns / 1e6);
+    else
+        snprintf(buf, size, "%.2f s", ns / 1e9);
+}
+
+static bool do_stats(int argc, char *argv[])
+{
+    if (argc != 1) {
+        report(1, "%s takes no arguments", argv[0]);
+        return false;
+    }
+
+    report(1, "%-12s %9s %10s %10s %10s %10s %10s", "command", "count",
+           "mean", "p50", "p99", "p999", "max");
+    for (cmd_element_t *c = cmd_list; c; c = c->next) {
+        histogram_t *h = c->latency;
+        if (!h || !h->count)
+            continue;
+        char mean[16], p50[16], p99[16], p999[16], max[16];
+        format_ns(mean, sizeof(mean), h->sum / h->count);
+        format_ns(p50, sizeof(p50), hist_percentile(h, 0.5));
+        format_ns(p99, sizeof(p99), hist_percentile(h, 0.99));
+        format_ns(p999, sizeof(p999), hist_percentile(h, 0.999));
+        format_ns(max, sizeof(max), h->max);
+        report(1, "%-12s %9lu %10s %10s %10s %10s %10s", c->name,
+               (unsigned long) h->count, mean, p50, p99, p999, max);
+        hist_reset(h);
+    }
+    return true;
+}
+
 static bool do_time(int argc, char *argv[])
 {
     double delta = delta_time(&last_time);
     bool ok = true;
     if (argc <= 1) {
         double elapsed = last_time - first_time;
-        report(1, "Elapsed time = %.3f, Delta time = %.3f", elapsed, delta);
+        report(1, "Elapsed time = %.6f, Delta time = %.6f", elapsed, delta);
     } else {
         ok = interpret_cmda(argc - 1, argv + 1);
         if (block_flag) {
             block_timing = true;
         } else {
             delta = delta_time(&last_time);
-            report(1, "Delta time = %.3f", delta);
+            report(1, "Delta time = %.6f", delta);
+        }
+    }
+
+    return ok;
+}
+
+static bool do_bench(int argc, char *argv[]);
+static bool do_trace(int argc, char *argv[]);
+static bool do_repeat(int argc, char *argv[]);
+static bool do_web(int argc, char *argv[]);
+
+/* Commands that change the state of the interpreter instead of running an
+ * operation.  Running them n times in a row would stack up files or blocks,
+ * and only their set up would be timed.
+ */
+static bool benchable(cmd_func_t operation)
+{
+    return operation != do_quit && operation != do_bench &&
+           operation != do_repeat && operation != do_source &&
+           operation != do_trace && operation != do_web &&
+           operation != do_record && operation != do_log;
+}
+
+/* Run a command n times and summarize how long the runs took.  The runs
+ * call the command directly, without the error accounting, recording and
+ * latency histograms of interpret_cmda, and with the verbosity lowered to 1
+ * so that the queue is not printed after each one.  Errors still show.
+ */
+static bool do_bench(int argc, char *argv[])
+{
+    int warmup = 0;
+    bool reset = false;
+    int i = 1;
+    for (; i < argc && argv[i][0] == '-'; i++) {
+        if (!strcmp(argv[i], "-r")) {
+            reset = true;
+        } else if (!strcmp(argv[i], "-w") && i + 1 < argc) {
+            if (!get_int(argv[++i], &warmup) || warmup < 0) {
+                report(1, "Invalid number of warmup runs '%s'", argv[i]);
+                return false;
+            }
+        } else {
+            report(1, "Unknown option '%s'", argv[i]);
+            return false;
+        }
+    }
+
+    int runs;
+    if (argc - i < 2) {
+        report(1, "%s needs a run count and a command", argv[0]);
+        return false;
+    }
+    if (!get_int(argv[i], &runs) || runs <= 0) {
+        report(1, "Invalid number of runs '%s'", argv[i]);
+        return false;
+    }
+    i++;
+
+    cmd_element_t *cmd = find_cmd(argv[i]);
+    if (!cmd) {
+        report(1, "Unknown command '%s'", argv[i]);
+        return false;
+    }
+    if (!benchable(cmd->operation)) {
+        report(1, "Cannot bench '%s'", argv[i]);
+        return false;
+    }
+    if (reset && !bench_reset) {
+        report(1, "Nothing to reset between runs");
+        return false;
+    }
+    if (reset && !bench_reset(BENCH_SAVE))
+        return false;
+
+    int cmd_argc = argc - i;
+    char **cmd_argv = argv + i;
+    histogram_t *hist = cmd_alloc(sizeof(histogram_t));
+    hist_reset(hist);
+    int saved_verblevel = verblevel;
+    if (verblevel > 1)
+        set_verblevel(1);
+
+    /* Running mean and sum of squared deviations, as in Welford's method */
+    double mean = 0, m2 = 0;
+    uint64_t total = 0;
+    bool ok = true;
+    cmd_mark_t mark;
+    cmd_mark(&mark);
+    for (int run = -warmup; run < runs && ok; run++) {
+        /* What the runs allocate from the arena */
+        cmd_release(&mark);
+        if (reset && !bench_reset(BENCH_RESTORE)) {
+            ok = false;
+            break;
+        }
+        uint64_t start = time_ns();
+        ok = cmd->operation(cmd_argc, cmd_argv);
+        uint64_t elapsed = time_ns() - start;
+        if (!ok) {
+            report(1, "%s failed in run %d", cmd->name, run + warmup + 1);
+            break;
+        }
+        if (run < 0)
+            continue;
+        hist_add(hist, elapsed);
+        total += elapsed;
+        double delta = elapsed - mean;
+        mean += delta / hist->count;
+        m2 += delta * (elapsed - mean);
+    }
+
+    set_verblevel(saved_verblevel);
+    if (reset)
+        bench_reset(BENCH_DISCARD);
+
+    if (ok) {
+        char min[16], avg[16], max[16], sd[16], p50[16], p99[16];
+        format_ns(min, sizeof(min), hist->min);
+        format_ns(avg, sizeof(avg), (uint64_t) mean);
+        format_ns(max, sizeof(max), hist->max);
+        format_ns(sd, sizeof(sd), (uint64_t) sqrt(m2 / hist->count));
+        format_ns(p50, sizeof(p50), hist_percentile(hist, 0.5));
+        format_ns(p99, sizeof(p99), hist_percentile(hist, 0.99));
+        report(1, "%d runs of %s: min %s, mean %s, max %s, stddev %s", runs,
+               cmd->name, min, avg, max, sd);
+        report(1, "p50 %s, p99 %s, %.0f runs/s", p50, p99,
+               runs / (total * 1e-9));
+    }
+    return ok;
+}
+
+/* Compiled traces.  A .cmd file is compiled to a header, a table of the
+ * command names it uses, a stream of 32-bit words with, for each command,
+ * the index of its name, argc and the offsets of its arguments, and a pool
+ * of the null-terminated words of the file.  'source' is expanded in place.
+ * Words are in the byte order of the machine that compiled the trace.
+ */
+#define TRACE_MAGIC "QTRACE1"
+#define TRACE_MAX_DEPTH 16 /* of nested 'source' */
+
+typedef struct {
+    char magic[8];
+    uint32_t n_names;
+    uint32_t n_ops;
+    uint32_t n_words; /* of the command stream */
+    uint32_t pool_size;
+} trace_header_t;
+
+/* Growing buffer for the parts of a trace being compiled */
+typedef struct {
+    char *data;
+    size_t len, cap;
+} trace_buf_t;
+
+typedef struct {
+    trace_buf_t names, words, pool;
+    uint32_t n_ops;
+} trace_compile_t;
+
+static void trace_put(trace_buf_t *b, const void *p, size_t n)
+{
+    if (b->len + n > b->cap) {
+        size_t cap = b->cap ? b->cap : 4096;
+        while (cap < b->len + n)
+            cap *= 2;
+        char *data = malloc_or_fail(cap, "trace_put");
+        if (b->data) {
+            memcpy(data, b->data, b->len);
+            free_block(b->data, b->cap);
+        }
+        b->data = data;
+        b->cap = cap;
+    }
+    memcpy(b->data + b->len, p, n);
+    b->len += n;
+}
+
+static uint32_t trace_string(trace_compile_t *tc, const char *s)
+{
+    uint32_t off = tc->pool.len;
+    trace_put(&tc->pool, s, strlen(s) + 1);
+    return off;
+}
+
+static void trace_compile_cmd(trace_compile_t *tc, int argc, char *argv[])
+{
+    uint32_t *names = (uint32_t *) tc->names.data;
+    uint32_t n_names = tc->names.len / sizeof(uint32_t);
+    uint32_t idx = 0;
+    while (idx < n_names && strcmp(tc->pool.data + names[idx], argv[0]))
+        idx++;
+    if (idx == n_names) {
+        uint32_t off = trace_string(tc, argv[0]);
+        trace_put(&tc->names, &off, sizeof(off));
+    }
+    uint32_t name = ((uint32_t *) tc->names.data)[idx];
+
+    uint32_t head[2] = {idx, argc};
+    trace_put(&tc->words, head, sizeof(head));
+    trace_put(&tc->words, &name, sizeof(name));
+    for (int i = 1; i < argc; i++) {
+        uint32_t off = trace_string(tc, argv[i]);
+        trace_put(&tc->words, &off, sizeof(off));
+    }
+    tc->n_ops++;
+}
+
+static bool trace_compile_file(trace_compile_t *tc,
+                               const char *fname,
+                               int depth)
+{
+    if (depth > TRACE_MAX_DEPTH) {
+        report(1, "Files sourced more than %d deep at '%s'", TRACE_MAX_DEPTH,
+               fname);
+        return false;
+    }
+    int fd = open(fname, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st)) {
+        report(1, "Could not open source file '%s'", fname);
+        if (fd >= 0)
+            close(fd);
+        return false;
+    }
+    size_t size = st.st_size;
+    char *buf = malloc_or_fail(size + 1, "trace_compile_file");
+    size_t got = 0;
+    ssize_t n = 1;
+    while (got < size && (n = read(fd, buf + got, size - got)) > 0)
+        got += n;
+    close(fd);
+    buf[got] = '\0';
+
+    bool ok = n >= 0;
+    if (!ok)
+        report(1, "Could not read '%s'", fname);
+    char *line = buf, *end = buf + got;
+    while (ok && line < end) {
+        char *nl = memchr(line, '\n', end - line);
+        if (nl)
+            *nl = '\0';
+        cmd_mark_t mark;
+        cmd_mark(&mark);
+        int argc;
+        char **argv = parse_args(line, &argc);
+        line = nl ? nl + 1 : end;
+        if (argc >= 2 && !strcmp(argv[0], "source")) {
+            ok = trace_compile_file(tc, argv[1], depth + 1);
+        } else if (argc && !strcmp(argv[0], "repeat") &&
+                   !strcmp(argv[argc - 1], "{")) {
+            report(1, "Repeat blocks cannot be compiled, in '%s'", fname);
+            ok = false;
+        } else if (argc > 0) {
+            trace_compile_cmd(tc, argc, argv);
+        }
+        cmd_release(&mark);
+    }
+    free_block(buf, size + 1);
+    return ok;
+}
+
+static bool trace_compile(const char *infile, const char *outfile)
+{
+    trace_compile_t tc;
+    memset(&tc, 0, sizeof(tc));
+    bool ok = trace_compile_file(&tc, infile, 0);
+
+    if (ok) {
+        trace_header_t h = {
+            .magic = TRACE_MAGIC,
+            .n_names = tc.names.len / sizeof(uint32_t),
+            .n_ops = tc.n_ops,
+            .n_words = tc.words.len / sizeof(uint32_t),
+            .pool_size = tc.pool.len,
+        };
+        FILE *f = fopen(outfile, "w");
+        ok = f && fwrite(&h, sizeof(h), 1, f) == 1 &&
+             fwrite(tc.names.data, 1, tc.names.len, f) == tc.names.len &&
+             fwrite(tc.words.data, 1, tc.words.len, f) == tc.words.len &&
+             fwrite(tc.pool.data, 1, tc.pool.len, f) == tc.pool.len;
+        if (f && fclose(f))
+            ok = false;
+        if (ok)
+            report(1, "Compiled %u commands of '%s' to '%s'", tc.n_ops, infile,
+                   outfile);
+        else
+            report(1, "Could not write '%s'", outfile);
+    }
+
+    trace_buf_t *bufs[] = {&tc.names, &tc.words, &tc.pool};
+    for (int i = 0; i < 3; i++) {
+        if (bufs[i]->data)
+            free_block(bufs[i]->data, bufs[i]->cap);
+    }
+    return ok;
+}
+
+static bool is_compiled_trace(const char *fname)
+{
+    char magic[sizeof(TRACE_MAGIC)];
+    int fd = open(fname, O_RDONLY);
+    if (fd < 0)
+        return false;
+    bool compiled = read(fd, magic, sizeof(magic)) == sizeof(magic) &&
+                    !memcmp(magic, TRACE_MAGIC, sizeof(magic));
+    close(fd);
+    return compiled;
+}
+
+/* A command of a compiled trace, ready to be called */
+typedef struct {
+    cmd_element_t *cmd;
+    int argc;
+    char **argv;
+} trace_op_t;
+
+/* Whether the parts a header promises make up the file */
+static bool trace_header_ok(const trace_header_t *h, size_t size)
+{
+    if (size < sizeof(*h) || memcmp(h->magic, TRACE_MAGIC, sizeof(h->magic)))
+        return false;
+    uint64_t n_ids = (uint64_t) h->n_names + h->n_words;
+    uint64_t expected = sizeof(*h) + sizeof(uint32_t) * n_ids + h->pool_size;
+    return expected == size && h->n_words >= 2 * (uint64_t) h->n_ops &&
+           (!h->pool_size || ((const char *) h)[size - 1] == '\0');
+}
+
+/* Check the command stream of a compiled trace and turn it into ops */
+static bool trace_load(trace_header_t *h, trace_op_t *ops, char **args)
+{
+    uint32_t *names = (uint32_t *) (h + 1);
+    uint32_t *words = names + h->n_names;
+    char *pool = (char *) (words + h->n_words);
+
+    cmd_element_t **cmds = cmd_alloc(h->n_names * sizeof(cmd_element_t *));
+    for (uint32_t i = 0; i < h->n_names; i++) {
+        if (names[i] >= h->pool_size)
+            return false;
+        cmds[i] = find_cmd(pool + names[i]);
+    }
+
+    uint32_t w = 0;
+    for (uint32_t i = 0; i < h->n_ops; i++) {
+        if (h->n_words - w < 2 || words[w] >= h->n_names)
+            return false;
+        uint32_t argc = words[w + 1];
+        if (!argc || argc > h->n_words - w - 2)
+            return false;
+        ops[i].cmd = cmds[words[w]];
+        ops[i].argc = argc;
+        ops[i].argv = args;
+        w += 2;
+        for (uint32_t j = 0; j < argc; j++, w++) {
+            if (words[w] >= h->pool_size)
+                return false;
+            *args++ = pool + words[w];
         }
     }
+    return w == h->n_words;
+}
 
+/* Run a compiled trace, calling each command's function directly */
+static bool trace_replay(const char *fname)
+{
+    int fd = open(fname, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st)) {
+        report(1, "Could not open compiled trace '%s'", fname);
+        if (fd >= 0)
+            close(fd);
+        return false;
+    }
+    /* Writable, as commands may change their arguments */
+    size_t size = st.st_size;
+    void *map = size ? mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+                            fd, 0)
+                     : MAP_FAILED;
+    close(fd);
+    trace_header_t *h = map;
+    if (map == MAP_FAILED || !trace_header_ok(h, size)) {
+        report(1, "'%s' is not a compiled trace", fname);
+        if (map != MAP_FAILED)
+            munmap(map, size);
+        return false;
+    }
+
+    cmd_mark_t start;
+    cmd_mark(&start);
+    /* Sizes are at least 1, for malloc_or_fail */
+    size_t ops_size = ((size_t) h->n_ops + 1) * sizeof(trace_op_t);
+    size_t args_size =
+        ((size_t) h->n_words - 2 * h->n_ops + 1) * sizeof(char *);
+    trace_op_t *ops = malloc_or_fail(ops_size, "trace_replay");
+    char **args = malloc_or_fail(args_size, "trace_replay");
+    bool ok = trace_load(h, ops, args);
+    if (!ok)
+        report(1, "Compiled trace '%s' is damaged", fname);
+
+    cmd_mark_t mark;
+    cmd_mark(&mark);
+    for (uint32_t i = 0; ok && i < h->n_ops && !quit_flag; i++) {
+        trace_op_t *op = &ops[i];
+        if (echo) {
+            report_noreturn(1, prompt);
+            for (int j = 0; j < op->argc; j++)
+                report_noreturn(1, j ? " %s" : "%s", op->argv[j]);
+            report(1, "");
+        }
+        if (subst_vars(op->argc, op->argv))
+            run_cmd(op->cmd, op->argc, op->argv);
+        else
+            record_error();
+        cmd_release(&mark);
+        report_flush();
+    }
+
+    cmd_release(&start);
+    free_block(ops, ops_size);
+    free_block(args, args_size);
+    munmap(map, size);
     return ok;
 }
 
+static bool do_trace(int argc, char *argv[])
+{
+    if (argc == 4 && !strcmp(argv[1], "compile"))
+        return trace_compile(argv[2], argv[3]);
+    if (argc == 3 && !strcmp(argv[1], "replay"))
+        return trace_replay(argv[2]);
+    report(1, "Usage: %s compile file.cmd file.qtb | replay file.qtb", argv[0]);
+    return false;
+}
+
+/* Variables, set with 'set' or by a loop and used as $name in any word but
+ * those of comments
+ */
+#define MAX_VARS 64
+
+typedef struct {
+    char *name;
+    char *value;  /* NULL until set, else num or a saved string */
+    char num[24]; /* value of a loop counter */
+} var_t;
+
+static var_t vars[MAX_VARS];
+static int var_cnt = 0;
+
+static bool valid_var_name(const char *name)
+{
+    if (!isalpha((unsigned char) *name) && *name != '_')
+        return false;
+    while (*++name) {
+        if (!isalnum((unsigned char) *name) && *name != '_')
+            return false;
+    }
+    return true;
+}
+
+/* Index of a variable, or -1 when it does not exist and cannot be made */
+static int find_var(const char *name, bool create)
+{
+    for (int i = 0; i < var_cnt; i++) {
+        if (!strcmp(vars[i].name, name))
+            return i;
+    }
+    if (!create || !valid_var_name(name) || var_cnt == MAX_VARS)
+        return -1;
+    vars[var_cnt].name = strsave_or_fail(name, "find_var");
+    vars[var_cnt].value = NULL;
+    return var_cnt++;
+}
+
+static void var_set(int v, const char *value)
+{
+    char *old = vars[v].value;
+    vars[v].value = strsave_or_fail(value, "var_set");
+    if (old && old != vars[v].num)
+        free_string(old);
+}
+
+static void var_set_num(int v, long n)
+{
+    if (vars[v].value && vars[v].value != vars[v].num)
+        free_string(vars[v].value);
+    snprintf(vars[v].num, sizeof(vars[v].num), "%ld", n);
+    vars[v].value = vars[v].num;
+}
+
+static const char *var_value(const char *name)
+{
+    int v = find_var(name, false);
+    if (v < 0 || !vars[v].value) {
+        report(1, "Variable '%s' is not set", name);
+        return NULL;
+    }
+    return vars[v].value;
+}
+
+/* Replace the $name words of a command line by their values */
+static bool subst_vars(int argc, char *argv[])
+{
+    if (argc && !strcmp(argv[0], "#"))
+        return true;
+    for (int i = 0; i < argc; i++) {
+        if (argv[i][0] == '$' && argv[i][1]) {
+            const char *value = var_value(argv[i] + 1);
+            if (!value)
+                return false;
+            argv[i] = (char *) value;
+        }
+    }
+    return true;
+}
+
+static void free_vars()
+{
+    for (int i = 0; i < var_cnt; i++) {
+        if (vars[i].value && vars[i].value != vars[i].num)
+            free_string(vars[i].value);
+        free_string(vars[i].name);
+    }
+    var_cnt = 0;
+}
+
+static bool do_set(int argc, char *argv[])
+{
+    if (argc == 1) {
+        for (int i = 0; i < var_cnt; i++) {
+            if (vars[i].value)
+                report(1, "%s = %s", vars[i].name, vars[i].value);
+        }
+        return true;
+    }
+    if (argc != 3) {
+        report(1, "%s takes a name and a value", argv[0]);
+        return false;
+    }
+    int v = find_var(argv[1], true);
+    if (v < 0) {
+        report(1, "Cannot set variable '%s'", argv[1]);
+        return false;
+    }
+    var_set(v, argv[2]);
+    return true;
+}
+
+/* Loops.  The lines of a repeat block are split into words as they are
+ * read and kept, as records of argc followed by the words, until the block
+ * closes.  They are then turned into ops, which hold the command element and
+ * words of each line, and run, so the body is not parsed again on each
+ * iteration.
+ */
+typedef struct {
+    cmd_element_t *cmd;
+    int argc;
+    char **words;  /* as read */
+    char **argv;   /* words with the variables replaced */
+    int *vars;     /* variable of each word or -1, NULL if there are none */
+    int count;     /* iterations of a repeat, -1 for a command */
+    int count_var; /* variable holding the count instead, or -1 */
+    int counter;   /* variable counting the iterations, or -1 */
+    int end;       /* op after the body of a repeat */
+} loop_op_t;
+
+static trace_buf_t loop_text;
+static int loop_records = 0;
+static bool loop_running = false;
+
+static void loop_put(int argc, char *argv[])
+{
+    uint32_t n = argc;
+    trace_put(&loop_text, &n, sizeof(n));
+    for (int i = 0; i < argc; i++)
+        trace_put(&loop_text, argv[i], strlen(argv[i]) + 1);
+    loop_records++;
+}
+
+static void loop_discard()
+{
+    if (loop_text.data)
+        free_block(loop_text.data, loop_text.cap);
+    memset(&loop_text, 0, sizeof(loop_text));
+    loop_records = 0;
+    loop_depth = 0;
+}
+
+/* Read the count of a repeat, given as a variable, when the repeat starts */
+static bool loop_count(int var, int *count)
+{
+    const char *value = var_value(vars[var].name);
+    if (!value)
+        return false;
+    if (!get_int((char *) value, count) || *count < 0) {
+        report(1, "Invalid repeat count '%s'", value);
+        return false;
+    }
+    return true;
+}
+
+/* Check the words of a repeat: repeat n [counter] { or repeat n cmd ...
+ * The words of a nested repeat are as read, so count_var is given: a $name
+ * count is left in it, to be read each time the repeat starts, and a $name
+ * counter is looked up now.  At the top level it is NULL.
+ */
+static bool loop_header(int argc,
+                        char *argv[],
+                        int *count,
+                        int *count_var,
+                        int *counter,
+                        bool *block)
+{
+    *block = argc >= 3 && !strcmp(argv[argc - 1], "{");
+    *counter = -1;
+    if (argc < 3 || (*block && argc > 4)) {
+        report(1, "Usage: %s n [counter] { or %s n cmd arg ...", argv[0],
+               argv[0]);
+        return false;
+    }
+    if (count_var && argv[1][0] == '$' && argv[1][1]) {
+        *count = 0;
+        *count_var = find_var(argv[1] + 1, true);
+        if (*count_var < 0) {
+            report(1, "Invalid repeat count '%s'", argv[1]);
+            return false;
+        }
+    } else if (!get_int(argv[1], count) || *count < 0) {
+        report(1, "Invalid repeat count '%s'", argv[1]);
+        return false;
+    } else if (count_var) {
+        *count_var = -1;
+    }
+    if (*block && argc == 4) {
+        const char *name = argv[2];
+        if (count_var && name[0] == '$' && name[1]) {
+            name = var_value(name + 1);
+            if (!name)
+                return false;
+        }
+        *counter = find_var(name, true);
+        if (*counter < 0) {
+            report(1, "Cannot use '%s' as a counter", name);
+            return false;
+        }
+    } else if (!*block && !strcmp(argv[2], "repeat")) {
+        report(1, "Nested repeat needs a block");
+        return false;
+    } else if (!*block && !find_cmd(argv[2])) {
+        /* Once, rather than on each of the iterations */
+        report(1, "Unknown command '%s'", argv[2]);
+        return false;
+    }
+    return true;
+}
+
+static void loop_op_init(loop_op_t *op, int argc, char *argv[])
+{
+    op->cmd = find_cmd(argv[0]);
+    op->argc = argc;
+    op->words = argv;
+    op->argv = cmd_alloc(argc * sizeof(char *));
+    memcpy(op->argv, argv, argc * sizeof(char *));
+    op->vars = NULL;
+    op->count = -1;
+    op->count_var = -1;
+    op->counter = -1;
+    if (!strcmp(argv[0], "#"))
+        return;
+    for (int i = 0; i < argc; i++) {
+        if (argv[i][0] != '$' || !argv[i][1])
+            continue;
+        if (!op->vars) {
+            op->vars = cmd_alloc(argc * sizeof(int));
+            for (int j = 0; j < argc; j++)
+                op->vars[j] = -1;
+        }
+        /* Made now, it may be set by a command before this one runs */
+        op->vars[i] = find_var(argv[i] + 1, true);
+    }
+}
+
+/* Turn the records into ops; returns their number, or -1 */
+static int loop_compile(loop_op_t *ops)
+{
+    int *stack = cmd_alloc(loop_records * sizeof(int));
+    int sp = 0, n = 0;
+    char *p = loop_text.data, *end = p + loop_text.len;
+    while (p < end) {
+        uint32_t argc;
+        memcpy(&argc, p, sizeof(argc));
+        p += sizeof(argc);
+        char **words = cmd_alloc(argc * sizeof(char *));
+        for (uint32_t i = 0; i < argc; i++) {
+            words[i] = p;
+            p += strlen(p) + 1;
+        }
+
+        if (argc == 1 && !strcmp(words[0], "}")) {
+            ops[stack[--sp]].end = n;
+            continue;
+        }
+        if (strcmp(words[0], "repeat")) {
+            if (!find_cmd(words[0])) {
+                report(1, "Unknown command '%s'", words[0]);
+                return -1;
+            }
+            loop_op_init(&ops[n++], argc, words);
+            continue;
+        }
+
+        int count, count_var, counter;
+        bool block;
+        if (!loop_header(argc, words, &count, &count_var, &counter, &block))
+            return -1;
+        loop_op_t *op = &ops[n];
+        memset(op, 0, sizeof(*op));
+        op->count = count;
+        op->count_var = count_var;
+        op->counter = counter;
+        if (block) {
+            stack[sp++] = n++;
+        } else {
+            op->end = n + 2;
+            loop_op_init(&ops[n + 1], argc - 2, words + 2);
+            n += 2;
+        }
+    }
+    return n;
+}
+
+static void loop_run(loop_op_t *ops, int from, int to)
+{
+    cmd_mark_t mark;
+    cmd_mark(&mark);
+    for (int i = from; i < to && !quit_flag; i++) {
+        loop_op_t *op = &ops[i];
+        if (op->count >= 0) {
+            int count = op->count;
+            if (op->count_var >= 0 && !loop_count(op->count_var, &count)) {
+                record_error();
+                count = 0;
+            }
+            for (int k = 0; k < count && !quit_flag; k++) {
+                if (op->counter >= 0)
+                    var_set_num(op->counter, k);
+                loop_run(ops, i + 1, op->end);
+            }
+            i = op->end - 1;
+            continue;
+        }
+
+        bool ok = true;
+        for (int j = 0; op->vars && j < op->argc; j++) {
+            if (op->vars[j] < 0)
+                continue;
+            const char *value = var_value(vars[op->vars[j]].name);
+            if (!value) {
+                ok = false;
+                break;
+            }
+            op->argv[j] = (char *) value;
+        }
+        if (ok)
+            run_cmd(op->cmd, op->argc, op->argv);
+        else
+            record_error();
+        cmd_release(&mark);
+    }
+}
+
+/* Run the collected block, now closed */
+static bool loop_finish()
+{
+    cmd_mark_t mark;
+    cmd_mark(&mark);
+    loop_op_t *ops = cmd_alloc(2 * loop_records * sizeof(loop_op_t));
+    int n = loop_compile(ops);
+    bool ok = n >= 0;
+    if (ok) {
+        loop_running = true;
+        loop_run(ops, 0, n);
+        loop_running = false;
+    } else {
+        record_error();
+    }
+    cmd_release(&mark);
+    loop_discard();
+    return ok;
+}
+
+/* Keep a line of an unclosed block; true when it closed the block */
+static bool loop_capture(int argc, char *argv[])
+{
+    if (!argc)
+        return false;
+    if (!strcmp(argv[0], "repeat") && !strcmp(argv[argc - 1], "{"))
+        loop_depth++;
+    else if (argc == 1 && !strcmp(argv[0], "}"))
+        loop_depth--;
+    loop_put(argc, argv);
+    return !loop_depth;
+}
+
+static bool do_repeat(int argc, char *argv[])
+{
+    int count, counter;
+    bool block;
+    if (loop_running || loop_depth) {
+        report(1, "%s cannot be run from a loop", argv[0]);
+        return false;
+    }
+    if (!loop_header(argc, argv, &count, NULL, &counter, &block))
+        return false;
+    loop_put(argc, argv);
+    if (block) {
+        loop_depth = 1;
+        return true;
+    }
+    return loop_finish();
+}
+
 static bool use_linenoise = true;
 static int web_fd;
 
 static bool do_web(int argc, char *argv[])
 {
     int port = 9999;
-    if (argc == 2) {
+    int threads = 2;
+    if (argc >= 2) {
         if (argv[1][0] >= '0' && argv[1][0] <= '9')
             port = atoi(argv[1]);
     }
+    if (argc >= 3) {
+        if (argv[2][0] >= '0' && argv[2][0] <= '9')
+            threads = atoi(argv[2]);
+    }
 
-    web_fd = web_open(port);
+    web_fd = web_open(port, threads);
     if (web_fd > 0) {
-        printf("listen on port %d, fd is %d\n", port, web_fd);
+        printf("listen on port %d, fd is %d, %d I/O threads\n", port, web_fd,
+               threads);
         line_set_eventmux_callback(web_eventmux);
         use_linenoise = false;
     } else {
@@ -419,6 +1461,8 @@ void init_cmd()
 {
     cmd_list = NULL;
     param_list = NULL;
+    memset(cmd_table, 0, sizeof(cmd_table));
+    memset(param_table, 0, sizeof(param_table));
     err_cnt = 0;
     quit_flag = false;
 
@@ -429,14 +1473,40 @@ void init_cmd()
     ADD_COMMAND(quit, "Exit program", "");
     ADD_COMMAND(source, "Read commands from source file", "");
     ADD_COMMAND(log, "Copy output to file", "file");
+    ADD_COMMAND(record,
+                "Record commands, results, timings and allocations to a "
+                "binary file, or stop recording",
+                "[file]");
     ADD_COMMAND(time, "Time command execution", "cmd arg ...");
-    ADD_COMMAND(web, "Read commands from builtin web server", "[port]");
+    ADD_COMMAND(bench,
+                "Run command n times and show its timing; -w runs w more "
+                "times first, untimed; -r restores the queue before each run",
+                "[-w w] [-r] n cmd arg ...");
+    ADD_COMMAND(trace,
+                "Compile a trace file to a binary one, or run a compiled one",
+                "compile in out | replay file");
+    ADD_COMMAND(repeat,
+                "Run a command, or the lines up to a matching '}', n times; "
+                "counter counts from 0",
+                "n [counter] { | n cmd arg ...");
+    ADD_COMMAND(set, "Set variable, used as $name, or list variables",
+                "[name value]");
+    ADD_COMMAND(stats,
+                "Show latency percentiles of each command since the last "
+                "stats, and start over",
+                "");
+    ADD_COMMAND(web,
+                "Read commands from builtin web server, served by I/O "
+                "threads",
+                "[port [threads]]");
     add_cmd("#", do_comment_cmd, "Display comment", "...");
     add_param("simulation", &simulation, "Start/Stop simulation mode", NULL);
     add_param("verbose", &verblevel, "Verbosity level", NULL);
     add_param("error", &err_limit, "Number of errors until exit", NULL);
     add_param("echo", &echo, "Do/don't echo commands", NULL);
     add_param("entropy", &show_entropy, "Show/Hide Shannon entropy", NULL);
+    add_param("logdrop", &log_drop,
+              "Drop log output instead of waiting for slow storage", NULL);
 
     init_in();
     init_time(&last_time);
@@ -461,6 +1531,27 @@ static bool push_file(char *fname)
     rnew->fd = fd;
     rnew->count = 0;
     rnew->bufptr = rnew->buf;
+    rnew->mapped = false;
+    rnew->map = NULL;
+    rnew->map_len = 0;
+
+    /* Pipes and terminals are read through buf */
+    struct stat st;
+    if (fname && !fstat(fd, &st) && S_ISREG(st.st_mode)) {
+        if (!st.st_size) {
+            rnew->mapped = true;
+        } else {
+            void *map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE,
+                             MAP_PRIVATE, fd, 0);
+            if (map != MAP_FAILED) {
+                madvise(map, st.st_size, MADV_SEQUENTIAL);
+                rnew->mapped = true;
+                rnew->map = map;
+                rnew->map_len = st.st_size;
+            }
+        }
+    }
+    rnew->mapptr = rnew->map;
     rnew->prev = buf_stack;
     buf_stack = rnew;
 
@@ -473,7 +1564,10 @@ static void pop_file()
     if (buf_stack) {
         rio_t *rsave = buf_stack;
         buf_stack = rsave->prev;
-        close(rsave->fd);
+        if (rsave->map)
+            munmap(rsave->map, rsave->map_len);
+        if (rsave->fd >= 0)
+            close(rsave->fd);
         free_block(rsave, sizeof(rio_t));
     }
 }
@@ -484,6 +1578,44 @@ static void init_in()
     buf_stack = NULL;
 }
 
+/* Next line of a mapped file.  It is terminated in place, where its newline
+ * was, unless it is too long or lacks a newline, and then it is copied to
+ * linebuf like lines read by readline.
+ */
+static char *map_readline()
+{
+    char *line = buf_stack->mapptr;
+    size_t left = buf_stack->map + buf_stack->map_len - line;
+    if (!left) {
+        /* Encountered EOF */
+        pop_file();
+        return NULL;
+    }
+
+    char *nl = memchr(line, '\n', left);
+    size_t len = nl ? nl - line : left;
+    if (nl && len < RIO_BUFSIZE - 2) {
+        *nl = '\0';
+        buf_stack->mapptr = nl + 1;
+    } else {
+        /* Last line of file did not terminate with newline, or hit buffer
+         * limit.  Artificially terminate line
+         */
+        if (len > RIO_BUFSIZE - 2)
+            len = RIO_BUFSIZE - 2;
+        memcpy(linebuf, line, len);
+        linebuf[len] = '\0';
+        buf_stack->mapptr = line + len;
+        line = linebuf;
+    }
+
+    if (echo) {
+        report_noreturn(1, prompt);
+        report(1, "%s", line);
+    }
+    return line;
+}
+
 /* Read command from input file.
  * When hit EOF, close that file and return NULL
  */
@@ -494,6 +1626,8 @@ static char *readline()
 
     if (!buf_stack)
         return NULL;
+    if (buf_stack->mapped)
+        return map_readline();
 
     for (int cnt = 0; cnt < RIO_BUFSIZE - 2; cnt++) {
         if (buf_stack->count <= 0) {
@@ -510,7 +1644,7 @@ static char *readline()
                     *lptr++ = '\0';
                     if (echo) {
                         report_noreturn(1, prompt);
-                        report_noreturn(1, linebuf);
+                        report_noreturn(1, "%s", linebuf);
                     }
                     return linebuf;
                 }
@@ -534,7 +1668,7 @@ static char *readline()
 
     if (echo) {
         report_noreturn(1, prompt);
-        report_noreturn(1, linebuf);
+        report_noreturn(1, "%s", linebuf);
     }
 
     return linebuf;
@@ -601,6 +1735,15 @@ bool finish_cmd()
     bool ok = true;
     if (!quit_flag)
         ok = ok && do_quit(0, NULL);
+    while (buf_stack)
+        pop_file();
+    if (loop_depth) {
+        report(1, "ERROR: Unterminated repeat block");
+        ok = false;
+    }
+    loop_discard();
+    free_vars();
+    arena_destroy();
     has_infile = false;
     return ok && err_cnt == 0;
 }
@@ -648,6 +1791,11 @@ void completion(const char *buf, line_completions_t *lc)
 
 bool run_console(char *infile_name)
 {
+    if (infile_name && is_compiled_trace(infile_name)) {
+        bool ok = trace_replay(infile_name);
+        return ok && err_cnt == 0;
+    }
+
     if (!push_file(infile_name)) {
         report(1, "ERROR: Could not open source file '%s'", infile_name);
         return false;
@@ -656,11 +1804,12 @@ bool run_console(char *infile_name)
     if (!has_infile) {
         char *cmdline;
         while (use_linenoise && (cmdline = linenoise(prompt))) {
+            /* Before the line is split into words */
+            line_history_add(cmdline); /* Add to the history. */
             interpret_cmd(cmdline);
-            line_history_add(cmdline);       /* Add to the history. */
             line_history_save(HISTORY_FILE); /* Save the history on disk. */
             line_free(cmdline);
-            while (buf_stack && buf_stack->fd != STDIN_FILENO)
+            while (!cmd_done() && buf_stack->fd != STDIN_FILENO)
                 cmd_select(0, NULL, NULL, NULL, NULL);
             has_infile = false;
         }
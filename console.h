@@ -4,6 +4,7 @@
 #include <stdbool.h>
 #include <sys/select.h>
 
+#include "histogram.h"
 #include "linenoise.h"
 
 #define HISTORY_FILE ".cmd_history"
@@ -18,13 +19,17 @@ typedef bool (*cmd_func_t)(int argc, char *argv[]);
 
 /* Information about each command */
 
-/* Organized as linked list in alphabetical order */
+/* Organized as linked list in alphabetical order, for help, and in a hash
+ * table, for lookup
+ */
 typedef struct __cmd_element {
     char *name;
     cmd_func_t operation;
     char *summary;
     char *param;
+    histogram_t *latency; /* of its runs since the last 'stats' */
     struct __cmd_element *next;
+    struct __cmd_element *hash_next; /* in the same hash bucket */
 } cmd_element_t;
 
 /* Optionally supply function that gets invoked when parameter changes */
@@ -38,6 +43,7 @@ typedef struct __param_element {
     /* Function that gets called whenever parameter changes */
     setter_func_t setter;
     struct __param_element *next;
+    struct __param_element *hash_next;
 } param_element_t;
 
 /* Initialize interpreter */
@@ -56,9 +62,35 @@ bool get_int(char *vname, int *loc);
 /* Add function to be executed as part of program exit */
 void add_quit_helper(cmd_func_t qf);
 
+/* How 'bench -r' uses the reset function */
+typedef enum { BENCH_SAVE, BENCH_RESTORE, BENCH_DISCARD } bench_reset_t;
+
+/* Set function that saves the program state before 'bench -r' starts,
+ * restores it before each run and discards the saved copy at the end.
+ * Return false if the state cannot be saved or restored.
+ */
+typedef bool (*reset_func_t)(bench_reset_t what);
+void set_bench_reset(reset_func_t rf);
+
 /* Turn echoing on/off */
 void set_echo(bool on);
 
+/* Allocate memory that is freed when the command line being run finishes.
+ * Never returns NULL.
+ */
+void *cmd_alloc(size_t bytes);
+
+/* Position in the memory of cmd_alloc, to free what was allocated after it
+ * before the command line finishes
+ */
+typedef struct {
+    void *chunk;
+    size_t used;
+} cmd_mark_t;
+
+void cmd_mark(cmd_mark_t *mark);
+void cmd_release(const cmd_mark_t *mark);
+
 /* Complete command interpretation */
 
 /* Return true if no errors occurred */
@@ -16,12 +16,6 @@ static struct list_head *l = NULL;
 
 #define dut_new() ((void) (l = q_new()))
 
-#define dut_size(n)                                \
-    do {                                           \
-        for (int __iter = 0; __iter < n; ++__iter) \
-            q_size(l);                             \
-    } while (0)
-
 #define dut_insert_head(s, n)    \
     do {                         \
         int j = n;               \
@@ -38,6 +32,80 @@ static struct list_head *l = NULL;
 
 #define dut_free() ((void) (q_free(l)))
 
+/* Insert and remove an element like the one about to be inserted, so that the
+ * measured insertion gets the memory just freed.  Otherwise it gets untouched
+ * memory from the top of the heap, and how cold that is depends on the length
+ * of the queue built before.
+ */
+static void dut_warm_insert(char *s)
+{
+    q_insert_head(l, s);
+    element_t *e = q_remove_head(l, NULL, 0);
+    if (e)
+        q_release_element(e);
+}
+
+/* Operations other than insertion and removal at either end cannot be
+ * constant time: queue.h keeps no length in the head, so even q_size walks the
+ * list.  For these, both classes build a queue of at least SCALED_LEN elements
+ * and each measurement is rescaled to what it would cost at SCALED_LEN,
+ * assuming the expected complexity.  A correct implementation then shows the
+ * same distribution for both classes, while an asymptotically slower one
+ * leaves the random (longer) class measurably behind.
+ */
+typedef enum {
+    COST_LINEAR,
+    COST_LINEARITHMIC,
+} cost_t;
+
+static double cost(cost_t c, int n)
+{
+    return c == COST_LINEARITHMIC ? (double) n * log2((double) n) : (double) n;
+}
+
+/* Building a queue of a few elements leaves the caches and branch predictors
+ * in a measurably different state than building a long one, which the t-test
+ * would attribute to the operation.  So neither class starts from a queue
+ * shorter than BASE_LEN.
+ */
+static int base_length(const uint8_t *input_data, size_t i)
+{
+    /* Class 0 has zeroed input, hence exactly BASE_LEN elements */
+    return BASE_LEN + *(uint16_t *) (input_data + i * CHUNK_SIZE) % 10000;
+}
+
+static int scaled_length(const uint8_t *input_data, size_t i)
+{
+    /* Class 0 has zeroed input, hence exactly SCALED_LEN elements */
+    return SCALED_LEN +
+           *(uint16_t *) (input_data + i * CHUNK_SIZE) % SCALED_LEN;
+}
+
+static void rescale(int64_t *before_ticks,
+                    int64_t *after_ticks,
+                    size_t i,
+                    cost_t c,
+                    int n)
+{
+    double ratio = cost(c, SCALED_LEN) / cost(c, n);
+    after_ticks[i] =
+        before_ticks[i] +
+        (int64_t) ((double) (after_ticks[i] - before_ticks[i]) * ratio);
+}
+
+static bool is_sorted(struct list_head *head)
+{
+    struct list_head *cur;
+    list_for_each (cur, head) {
+        if (cur->next == head)
+            break;
+        if (strcmp(list_entry(cur, element_t, list)->value,
+                   list_entry(cur->next, element_t, list)->value) > 0)
+            return false;
+    }
+    return true;
+}
+
 static char random_string[N_MEASURES][8];
 static int random_string_iter = 0;
 
@@ -53,11 +121,6 @@ static char *get_random_string(void)
     return random_string[random_string_iter];
 }
 
-static int cmp(const int64_t *a, const int64_t *b)
-{
-    return (int) (*a - *b);
-}
-
 void prepare_inputs(uint8_t *input_data, uint8_t *classes)
 {
     randombytes(input_data, N_MEASURES * CHUNK_SIZE);
@@ -74,47 +137,138 @@ void prepare_inputs(uint8_t *input_data, uint8_t *classes)
     }
 }
 
-static int64_t percentile(int64_t *a_sorted, double which, size_t size)
+/* Rank in a sorted batch of each percentile threshold, ascending */
+static size_t percentile_ranks[N_PERCENTILES];
+/* The same ranks without duplicates */
+static size_t distinct_ranks[N_PERCENTILES];
+static size_t n_distinct_ranks;
+
+static void init_percentile_ranks(void)
 {
-    size_t array_position = (size_t) ((double) size * (double) which);
-    assert(array_position < size);
-    return a_sorted[array_position];
+    for (size_t i = 0; i < N_PERCENTILES; i++) {
+        double which = 1 - (pow(0.5, 10 * (double) (i + 1) / N_PERCENTILES));
+        size_t rank = (size_t) ((double) N_MEASURES * which);
+        assert(rank < N_MEASURES);
+        percentile_ranks[i] = rank;
+        if (!n_distinct_ranks ||
+            distinct_ranks[n_distinct_ranks - 1] != rank)
+            distinct_ranks[n_distinct_ranks++] = rank;
+    }
 }
 
-void prepare_percentiles(int64_t *exec_times, int64_t *percentiles)
+static inline void swap_times(int64_t *a, int64_t *b)
 {
-    qsort(exec_times, N_MEASURES, sizeof(int64_t),
-          (int (*)(const void *, const void *)) cmp);
-    for (size_t i = 0; i < N_PERCENTILES; i++) {
-        percentiles[i] = percentile(
-            exec_times, 1 - (pow(0.5, 10 * (double) (i + 1) / N_PERCENTILES)),
-            N_MEASURES);
+    int64_t tmp = *a;
+    *a = *b;
+    *b = tmp;
+}
+
+static void insertion_sort(int64_t *a, size_t lo, size_t hi)
+{
+    for (size_t i = lo + 1; i < hi; i++) {
+        int64_t x = a[i];
+        size_t j = i;
+        for (; j > lo && a[j - 1] > x; j--)
+            a[j] = a[j - 1];
+        a[j] = x;
     }
 }
 
+/* Rearrange a[lo, hi) so that every position listed in ranks holds the value
+ * it would hold if the range were sorted, with smaller values before it and
+ * larger ones after.  Only the parts of the range that contain a rank are
+ * partitioned further, so the work is well below a full sort when the ranks
+ * are clustered, as they are here.
+ */
+static void select_ranks(int64_t *a,
+                         size_t lo,
+                         size_t hi,
+                         const size_t *ranks,
+                         size_t n_ranks)
+{
+    while (n_ranks && hi - lo > 16) {
+        /* Median of three, then a three-way partition so that runs of equal
+         * timings (common with a coarse counter) are settled at once.
+         */
+        size_t mid = lo + (hi - lo) / 2;
+        if (a[mid] < a[lo])
+            swap_times(&a[mid], &a[lo]);
+        if (a[hi - 1] < a[lo])
+            swap_times(&a[hi - 1], &a[lo]);
+        if (a[hi - 1] < a[mid])
+            swap_times(&a[hi - 1], &a[mid]);
+        int64_t pivot = a[mid];
+
+        size_t lt = lo, i = lo, gt = hi;
+        while (i < gt) {
+            if (a[i] < pivot)
+                swap_times(&a[lt++], &a[i++]);
+            else if (a[i] > pivot)
+                swap_times(&a[i], &a[--gt]);
+            else
+                i++;
+        }
+
+        size_t n_left = 0;
+        while (n_left < n_ranks && ranks[n_left] < lt)
+            n_left++;
+        size_t n_mid = n_left;
+        while (n_mid < n_ranks && ranks[n_mid] < gt)
+            n_mid++;
+
+        /* Recurse into the side with fewer ranks, loop on the other */
+        if (n_left < n_ranks - n_mid) {
+            select_ranks(a, lo, lt, ranks, n_left);
+            ranks += n_mid;
+            n_ranks -= n_mid;
+            lo = gt;
+        } else {
+            select_ranks(a, gt, hi, ranks + n_mid, n_ranks - n_mid);
+            n_ranks = n_left;
+            hi = lt;
+        }
+    }
+
+    if (n_ranks)
+        insertion_sort(a, lo, hi);
+}
+
+/* Compute the percentile thresholds of a batch.  The selection reorders a
+ * copy, so exec_times stays aligned with the classes of the batch.
+ */
+void prepare_percentiles(const int64_t *exec_times,
+                         int64_t *percentiles)
+{
+    static int64_t sorted[N_MEASURES];
+
+    if (!n_distinct_ranks)
+        init_percentile_ranks();
+
+    memcpy(sorted, exec_times, sizeof(sorted));
+    select_ranks(sorted, 0, N_MEASURES, distinct_ranks, n_distinct_ranks);
+    for (size_t i = 0; i < N_PERCENTILES; i++)
+        percentiles[i] = sorted[percentile_ranks[i]];
+}
+
 bool measure(int64_t *before_ticks,
              int64_t *after_ticks,
              uint8_t *input_data,
              int mode)
 {
-    assert(mode == DUT(insert_head) || mode == DUT(insert_tail) ||
-           mode == DUT(remove_head) || mode == DUT(remove_tail));
-
     switch (mode) {
     case DUT(insert_head):
         for (size_t i = DROP_SIZE; i < N_MEASURES - DROP_SIZE; i++) {
             char *s = get_random_string();
             dut_new();
-            dut_insert_head(
-                get_random_string(),
-                *(uint16_t *) (input_data + i * CHUNK_SIZE) % 10000);
-            int before_size = q_size(l);
+            int n = base_length(input_data, i);
+            dut_insert_head(get_random_string(), n);
+            dut_warm_insert(s);
             before_ticks[i] = cpucycles();
             dut_insert_head(s, 1);
             after_ticks[i] = cpucycles();
             int after_size = q_size(l);
             dut_free();
-            if (before_size != after_size - 1)
+            if (after_size != n + 1)
                 return false;
         }
         break;
@@ -122,26 +276,23 @@ bool measure(int64_t *before_ticks,
         for (size_t i = DROP_SIZE; i < N_MEASURES - DROP_SIZE; i++) {
             char *s = get_random_string();
             dut_new();
-            dut_insert_head(
-                get_random_string(),
-                *(uint16_t *) (input_data + i * CHUNK_SIZE) % 10000);
-            int before_size = q_size(l);
+            int n = base_length(input_data, i);
+            dut_insert_head(get_random_string(), n);
+            dut_warm_insert(s);
             before_ticks[i] = cpucycles();
             dut_insert_tail(s, 1);
             after_ticks[i] = cpucycles();
             int after_size = q_size(l);
             dut_free();
-            if (before_size != after_size - 1)
+            if (after_size != n + 1)
                 return false;
         }
         break;
     case DUT(remove_head):
         for (size_t i = DROP_SIZE; i < N_MEASURES - DROP_SIZE; i++) {
             dut_new();
-            dut_insert_head(
-                get_random_string(),
-                *(uint16_t *) (input_data + i * CHUNK_SIZE) % 10000 + 1);
-            int before_size = q_size(l);
+            int n = base_length(input_data, i);
+            dut_insert_head(get_random_string(), n);
             before_ticks[i] = cpucycles();
             element_t *e = q_remove_head(l, NULL, 0);
             after_ticks[i] = cpucycles();
@@ -149,17 +300,15 @@ bool measure(int64_t *before_ticks,
             if (e)
                 q_release_element(e);
             dut_free();
-            if (before_size != after_size + 1)
+            if (!e || after_size != n - 1)
                 return false;
         }
         break;
     case DUT(remove_tail):
         for (size_t i = DROP_SIZE; i < N_MEASURES - DROP_SIZE; i++) {
             dut_new();
-            dut_insert_head(
-                get_random_string(),
-                *(uint16_t *) (input_data + i * CHUNK_SIZE) % 10000 + 1);
-            int before_size = q_size(l);
+            int n = base_length(input_data, i);
+            dut_insert_head(get_random_string(), n);
             before_ticks[i] = cpucycles();
             element_t *e = q_remove_tail(l, NULL, 0);
             after_ticks[i] = cpucycles();
@@ -167,21 +316,90 @@ bool measure(int64_t *before_ticks,
             if (e)
                 q_release_element(e);
             dut_free();
-            if (before_size != after_size + 1)
+            if (!e || after_size != n - 1)
                 return false;
         }
         break;
-    default:
+    case DUT(size):
         for (size_t i = DROP_SIZE; i < N_MEASURES - DROP_SIZE; i++) {
+            int n = scaled_length(input_data, i);
             dut_new();
-            dut_insert_head(
-                get_random_string(),
-                *(uint16_t *) (input_data + i * CHUNK_SIZE) % 10000);
+            dut_insert_head(get_random_string(), n);
             before_ticks[i] = cpucycles();
-            dut_size(1);
+            int size = q_size(l);
             after_ticks[i] = cpucycles();
             dut_free();
+            rescale(before_ticks, after_ticks, i, COST_LINEAR, n);
+            if (size != n)
+                return false;
         }
+        break;
+    case DUT(delete_mid):
+        for (size_t i = DROP_SIZE; i < N_MEASURES - DROP_SIZE; i++) {
+            int n = scaled_length(input_data, i);
+            dut_new();
+            dut_insert_head(get_random_string(), n);
+            before_ticks[i] = cpucycles();
+            bool ok = q_delete_mid(l);
+            after_ticks[i] = cpucycles();
+            int after_size = q_size(l);
+            dut_free();
+            rescale(before_ticks, after_ticks, i, COST_LINEAR, n);
+            if (!ok || after_size != n - 1)
+                return false;
+        }
+        break;
+    case DUT(reverse):
+        for (size_t i = DROP_SIZE; i < N_MEASURES - DROP_SIZE; i++) {
+            int n = scaled_length(input_data, i);
+            dut_new();
+            dut_insert_head(get_random_string(), n);
+            struct list_head *first = l->next;
+            before_ticks[i] = cpucycles();
+            q_reverse(l);
+            after_ticks[i] = cpucycles();
+            bool ok = l->prev == first && q_size(l) == n;
+            dut_free();
+            rescale(before_ticks, after_ticks, i, COST_LINEAR, n);
+            if (!ok)
+                return false;
+        }
+        break;
+    case DUT(swap):
+        for (size_t i = DROP_SIZE; i < N_MEASURES - DROP_SIZE; i++) {
+            int n = scaled_length(input_data, i);
+            dut_new();
+            dut_insert_head(get_random_string(), n);
+            struct list_head *first = l->next;
+            before_ticks[i] = cpucycles();
+            q_swap(l);
+            after_ticks[i] = cpucycles();
+            bool ok = l->next->next == first && q_size(l) == n;
+            dut_free();
+            rescale(before_ticks, after_ticks, i, COST_LINEAR, n);
+            if (!ok)
+                return false;
+        }
+        break;
+    case DUT(sort):
+        for (size_t i = DROP_SIZE; i < N_MEASURES - DROP_SIZE; i++) {
+            int n = scaled_length(input_data, i);
+            dut_new();
+            for (int j = 0; j < n; j++)
+                q_insert_head(l, get_random_string());
+            before_ticks[i] = cpucycles();
+            q_sort(l, false);
+            after_ticks[i] = cpucycles();
+            bool ok = is_sorted(l) && q_size(l) == n;
+            dut_free();
+            rescale(before_ticks, after_ticks, i, COST_LINEARITHMIC, n);
+            if (!ok)
+                return false;
+        }
+        break;
+    default:
+        assert(0 && "unknown DUT");
+        return false;
     }
     return true;
 }
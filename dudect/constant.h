@@ -13,11 +13,28 @@
 
 #define DROP_SIZE 20
 
+/* Queue length used by the fixed class when testing operations which are not
+ * expected to run in constant time.  The random class draws its length from
+ * [SCALED_LEN, 2 * SCALED_LEN).  Long enough that neither class fits in the L1
+ * cache, which would make the shorter queues cheaper per element.
+ */
+#define SCALED_LEN 1024
+
+/* Queue length used by the fixed class when testing insertion and removal.
+ * The random class draws its length from [BASE_LEN, BASE_LEN + 10000).
+ */
+#define BASE_LEN 1000
+
 #define DUT_FUNCS  \
     _(insert_head) \
     _(insert_tail) \
     _(remove_head) \
-    _(remove_tail)
+    _(remove_tail) \
+    _(size)        \
+    _(delete_mid)  \
+    _(reverse)     \
+    _(swap)        \
+    _(sort)
 
 #define DUT(x) DUT_##x
 
@@ -29,8 +46,8 @@ enum {
 
 void init_dut();
 void prepare_inputs(uint8_t *input_data, uint8_t *classes);
-void prepare_percentiles();
-void prepare_percentiles(int64_t *exec_times, int64_t *percentiles);
+void prepare_percentiles(const int64_t *exec_times,
+                         int64_t *percentiles);
 bool measure(int64_t *before_ticks,
              int64_t *after_ticks,
              uint8_t *input_data,
@@ -0,0 +1,229 @@
+/**
+ * Run-time selectable cycle counters.
+ *
+ * The timestamp counter backends live inline in cpucycles.h.  The perf
+ * backends count user-space cycles or retired instructions of this thread
+ * through perf_event_open(2); when the kernel lets user space read the
+ * counter directly (cap_user_rdpmc), the value is taken with rdpmc, which
+ * avoids a system call per measurement.
+ */
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#include "cpucycles.h"
+
+#define NOISE_SAMPLES 10000
+
+int cpucycles_backend = CPUCYCLES_TSC_FENCED;
+
+static const char *names[N_CPUCYCLES] = {
+    [CPUCYCLES_TSC] = "tsc",
+    [CPUCYCLES_TSC_FENCED] = "tsc-fenced",
+    [CPUCYCLES_TSCP] = "tscp",
+    [CPUCYCLES_PERF_CYCLES] = "perf-cycles",
+    [CPUCYCLES_PERF_INSTRUCTIONS] = "perf-instructions",
+};
+
+#ifdef __linux__
+static int perf_fd = -1;
+static int perf_backend = -1;
+static pid_t perf_pid;
+static struct perf_event_mmap_page *perf_page;
+
+static void perf_close(void)
+{
+    if (perf_page) {
+        munmap(perf_page, sysconf(_SC_PAGESIZE));
+        perf_page = NULL;
+    }
+    if (perf_fd >= 0) {
+        close(perf_fd);
+        perf_fd = -1;
+    }
+    perf_backend = -1;
+}
+
+static bool perf_open(int backend)
+{
+    if (perf_backend == backend && perf_pid == getpid())
+        return true;
+    perf_close();
+
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.size = sizeof(attr);
+    attr.config = backend == CPUCYCLES_PERF_CYCLES
+                      ? PERF_COUNT_HW_CPU_CYCLES
+                      : PERF_COUNT_HW_INSTRUCTIONS;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+
+    /* This thread, on any CPU.  A forked worker inherits the descriptor but
+     * it keeps counting the parent, hence the pid check above.
+     */
+    int fd = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+    if (fd < 0)
+        return false;
+
+    perf_fd = fd;
+    perf_backend = backend;
+    perf_pid = getpid();
+    void *page = mmap(NULL, sysconf(_SC_PAGESIZE), PROT_READ, MAP_SHARED,
+                      fd, 0);
+    if (page != MAP_FAILED)
+        perf_page = page;
+    ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+    ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+    return true;
+}
+
+#if defined(__i386__) || defined(__x86_64__)
+static inline uint64_t rdpmc(unsigned int counter)
+{
+    unsigned int hi, lo;
+    __asm__ volatile("rdpmc" : "=a"(lo), "=d"(hi) : "c"(counter));
+    return ((uint64_t) lo) | (((uint64_t) hi) << 32);
+}
+
+/* Self-monitoring read as documented in linux/perf_event.h.  Return false if
+ * the counter is not currently scheduled on this CPU.
+ */
+static bool perf_read_rdpmc(int64_t *value)
+{
+    struct perf_event_mmap_page *pc = perf_page;
+    uint32_t seq;
+    int64_t count;
+    bool ok;
+
+    do {
+        seq = pc->lock;
+        __asm__ volatile("" ::: "memory");
+        uint32_t idx = pc->index;
+        count = pc->offset;
+        ok = pc->cap_user_rdpmc && idx;
+        if (ok) {
+            uint16_t width = pc->pmc_width;
+            int64_t pmc = rdpmc(idx - 1);
+            pmc <<= 64 - width;
+            pmc >>= 64 - width;
+            count += pmc;
+        }
+        __asm__ volatile("" ::: "memory");
+    } while (pc->lock != seq);
+
+    *value = count;
+    return ok;
+}
+#endif
+
+int64_t cpucycles_perf(void)
+{
+    int64_t value;
+
+#if defined(__i386__) || defined(__x86_64__)
+    if (perf_page && perf_read_rdpmc(&value))
+        return value;
+#endif
+    if (read(perf_fd, &value, sizeof(value)) != sizeof(value))
+        return 0;
+    return value;
+}
+#else
+static bool perf_open(int backend)
+{
+    (void) backend;
+    return false;
+}
+
+int64_t cpucycles_perf(void)
+{
+    return 0;
+}
+#endif
+
+static bool available(int backend)
+{
+    switch (backend) {
+    case CPUCYCLES_TSC:
+    case CPUCYCLES_TSC_FENCED:
+        return true;
+    case CPUCYCLES_TSCP:
+#if defined(__i386__) || defined(__x86_64__)
+        return true;
+#else
+        return false;
+#endif
+    case CPUCYCLES_PERF_CYCLES:
+    case CPUCYCLES_PERF_INSTRUCTIONS:
+        return perf_open(backend);
+    default:
+        return false;
+    }
+}
+
+bool cpucycles_select(int backend)
+{
+    if (!available(backend))
+        return false;
+    cpucycles_backend = backend;
+    return true;
+}
+
+const char *cpucycles_name(int backend)
+{
+    if (backend < 0 || backend >= N_CPUCYCLES)
+        return "unknown";
+    return names[backend];
+}
+
+static int cmp(const int64_t *a, const int64_t *b)
+{
+    return (*a > *b) - (*a < *b);
+}
+
+bool cpucycles_noise(int backend, int64_t *min, double *median, double *stddev)
+{
+    int saved = cpucycles_backend;
+    if (!cpucycles_select(backend))
+        return false;
+
+    int64_t *deltas = malloc(NOISE_SAMPLES * sizeof(int64_t));
+    if (!deltas) {
+        cpucycles_select(saved);
+        return false;
+    }
+
+    /* Same instruction sequence the measurement loop in constant.c uses */
+    for (size_t i = 0; i < NOISE_SAMPLES; i++) {
+        int64_t before = cpucycles();
+        int64_t after = cpucycles();
+        deltas[i] = after - before;
+    }
+    cpucycles_select(saved);
+
+    double mean = 0, m2 = 0;
+    for (size_t i = 0; i < NOISE_SAMPLES; i++) {
+        double delta = deltas[i] - mean;
+        mean += delta / (i + 1);
+        m2 += delta * (deltas[i] - mean);
+    }
+    qsort(deltas, NOISE_SAMPLES, sizeof(int64_t),
+          (int (*)(const void *, const void *)) cmp);
+
+    *min = deltas[0];
+    *median = deltas[NOISE_SAMPLES / 2];
+    *stddev = sqrt(m2 / (NOISE_SAMPLES - 1));
+    free(deltas);
+    return true;
+}
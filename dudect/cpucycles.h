@@ -1,10 +1,39 @@
 #ifndef DUDECT_CPUCYCLES_H
 #define DUDECT_CPUCYCLES_H
 
+#include <stdbool.h>
 #include <stdint.h>
 
-// http://www.intel.com/content/www/us/en/embedded/training/ia-32-ia-64-benchmark-code-execution-paper.html
-static inline int64_t cpucycles(void)
+/* Timing backends, selectable at run time */
+typedef enum {
+    CPUCYCLES_TSC,          /* bare rdtsc / cntvct_el0, no serialization */
+    CPUCYCLES_TSC_FENCED,   /* lfence; rdtsc; lfence  or  isb; cntvct_el0 */
+    CPUCYCLES_TSCP,         /* rdtscp; lfence */
+    CPUCYCLES_PERF_CYCLES,  /* perf_event_open cycle counter */
+    CPUCYCLES_PERF_INSTRUCTIONS, /* perf_event_open instruction counter */
+    N_CPUCYCLES,
+} cpucycles_backend_t;
+
+/* Backend used by cpucycles() */
+extern int cpucycles_backend;
+
+/* Switch cpucycles() to the given backend.
+ * Return false, leaving the current backend in place, if it is not available.
+ */
+bool cpucycles_select(int backend);
+
+/* Human readable name of a backend */
+const char *cpucycles_name(int backend);
+
+/* Measure the noise floor of a backend: the spread of readings taken back to
+ * back around an empty region.  Return false if the backend is unavailable.
+ */
+bool cpucycles_noise(int backend, int64_t *min, double *median, double *stddev);
+
+/* Read the counter opened by cpucycles_select() for the perf backends */
+int64_t cpucycles_perf(void);
+
+static inline int64_t cpucycles_tsc(void)
 {
 #if defined(__i386__) || defined(__x86_64__)
     unsigned int hi, lo;
@@ -26,4 +55,57 @@ static inline int64_t cpucycles(void)
 #endif
 }
 
+/* Keep earlier instructions from completing after the counter is read, and
+ * later ones from starting before.
+ */
+static inline int64_t cpucycles_tsc_fenced(void)
+{
+#if defined(__i386__) || defined(__x86_64__)
+    unsigned int hi, lo;
+    __asm__ volatile("lfence\n\trdtsc\n\tlfence\n\t"
+                     : "=a"(lo), "=d"(hi)
+                     :
+                     : "memory");
+    return ((int64_t) lo) | (((int64_t) hi) << 32);
+
+#elif defined(__aarch64__)
+    uint64_t val;
+    asm volatile("isb\n\tmrs %0, cntvct_el0\n\tisb" : "=r"(val) : : "memory");
+    return val;
+#else
+#error Unsupported Architecture
+#endif
+}
+
+#if defined(__i386__) || defined(__x86_64__)
+/* rdtscp waits for earlier instructions; the lfence holds back later ones */
+static inline int64_t cpucycles_tscp(void)
+{
+    unsigned int hi, lo, aux;
+    __asm__ volatile("rdtscp\n\tlfence\n\t"
+                     : "=a"(lo), "=d"(hi), "=c"(aux)
+                     :
+                     : "memory");
+    return ((int64_t) lo) | (((int64_t) hi) << 32);
+}
+#endif
+
+// http://www.intel.com/content/www/us/en/embedded/training/ia-32-ia-64-benchmark-code-execution-paper.html
+static inline int64_t cpucycles(void)
+{
+    switch (cpucycles_backend) {
+    case CPUCYCLES_TSC:
+        return cpucycles_tsc();
+#if defined(__i386__) || defined(__x86_64__)
+    case CPUCYCLES_TSCP:
+        return cpucycles_tscp();
+#endif
+    case CPUCYCLES_PERF_CYCLES:
+    case CPUCYCLES_PERF_INSTRUCTIONS:
+        return cpucycles_perf();
+    default:
+        return cpucycles_tsc_fenced();
+    }
+}
+
 #endif
@@ -24,38 +24,77 @@
  *
  *  - as long as any of the different test fails, the code will be deemed
  *    variable time.
+ *
+ *  - the measurements of one test are independent batches, so they can be
+ *    spread over several worker processes pinned to distinct cores. Each
+ *    worker keeps its own t-test contexts, which are merged before the
+ *    verdict. Processes rather than threads are used because the queue
+ *    under test allocates through the (single-threaded) test harness.
+ *
+ *  - in adaptive mode the batches keep coming until the verdict is clear:
+ *    either the t statistic is far above the failure threshold, or it is so
+ *    small that it could not reach the threshold within the measurement
+ *    budget, since a real leak makes t grow with the square root of the
+ *    number of measurements.
  */
 
+#if defined(__linux__)
+#define _GNU_SOURCE
+#include <sched.h>
+#endif
+
 #include <assert.h>
 #include <math.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "../console.h"
 #include "../random.h"
 
 #include "constant.h"
+#include "cpucycles.h"
 #include "fixture.h"
 #include "ttest.h"
 
 #define ENOUGH_MEASURE 10000
 #define TEST_TRIES 10
+#define MAX_MEASURE (ENOUGH_MEASURE * TEST_TRIES)
+#define MAX_WORKERS 64
+
+/* Number of worker processes measuring in parallel */
+int dudect_workers = 1;
+
+/* Stop measuring as soon as the verdict is clear */
+int dudect_adaptive = 0;
 
 static t_context_t *ttest_ctxs[N_TESTS];
 
+/* Buffers of one batch of measurements, reused across batches */
+static int64_t before_ticks[N_MEASURES + 1];
+static int64_t after_ticks[N_MEASURES + 1];
+static int64_t exec_times[N_MEASURES];
+static uint8_t classes[N_MEASURES];
+static uint8_t input_data[N_MEASURES * CHUNK_SIZE];
+static int64_t percentiles[N_PERCENTILES];
+
+/* What a worker sends back to the parent */
+typedef struct {
+    bool ok;
+    t_context_t ctxs[N_TESTS];
+} worker_result_t;
+
 /* threshold values for Welch's t-test */
 enum {
     t_threshold_bananas = 500, /* Test failed with overwhelming probability */
     t_threshold_moderate = 10, /* Test failed */
+    t_threshold_decisive = 20, /* Test failed, no need to measure further */
 };
 
-static void __attribute__((noreturn)) die(void)
-{
-    exit(111);
-}
-
 static void differentiate(int64_t *exec_times,
                           const int64_t *before_ticks,
                           const int64_t *after_ticks)
@@ -64,10 +103,35 @@ static void differentiate(int64_t *exec_times,
         exec_times[i] = after_ticks[i] - before_ticks[i];
 }
 
+/* Index of the first percentile threshold above difference, N_PERCENTILES if
+ * there is none.  The thresholds are in ascending order.
+ */
+static size_t crop_of(int64_t difference, const int64_t *percentiles)
+{
+    size_t lo = 0, hi = N_PERCENTILES;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (difference < percentiles[mid])
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+    return lo;
+}
+
 static void update_statistics(const int64_t *exec_times,
                               uint8_t *classes,
                               int64_t *percentiles)
 {
+    /* crops[k] gathers the samples whose first threshold is k.  Test k + 1
+     * keeps every sample below threshold k, i.e. crops 0 to k, so the tests
+     * receive running merges of the crops instead of one push per test and
+     * sample.
+     */
+    t_context_t crops[N_PERCENTILES];
+    for (size_t k = 0; k < N_PERCENTILES; k++)
+        t_init(&crops[k]);
+
     for (size_t i = 0; i < N_MEASURES; i++) {
         int64_t difference = exec_times[i];
         /* CPU cycle counter overflowed or dropped measurement */
@@ -77,11 +141,16 @@ static void update_statistics(const int64_t *exec_times,
         /* do a t-test on the execution time */
         t_push(ttest_ctxs[0], difference, classes[i]);
 
-        for (size_t crop_index = 0; crop_index < N_PERCENTILES; crop_index++) {
-            if (difference < percentiles[crop_index]) {
-                t_push(ttest_ctxs[crop_index + 1], difference, classes[i]);
-            }
-        }
+        size_t crop_index = crop_of(difference, percentiles);
+        if (crop_index < N_PERCENTILES)
+            t_push(&crops[crop_index], difference, classes[i]);
+    }
+
+    t_context_t below;
+    t_init(&below);
+    for (size_t crop_index = 0; crop_index < N_PERCENTILES; crop_index++) {
+        t_merge(&below, &crops[crop_index]);
+        t_merge(ttest_ctxs[crop_index + 1], &below);
     }
 }
 
@@ -141,34 +210,17 @@ static bool report(void)
     return true;
 }
 
+/* Measure one batch and accumulate it into the t-test contexts */
 static bool doit(int mode)
 {
-    int64_t *before_ticks = calloc(N_MEASURES + 1, sizeof(int64_t));
-    int64_t *after_ticks = calloc(N_MEASURES + 1, sizeof(int64_t));
-    int64_t *exec_times = calloc(N_MEASURES, sizeof(int64_t));
-    uint8_t *classes = calloc(N_MEASURES, sizeof(uint8_t));
-    uint8_t *input_data = calloc(N_MEASURES * CHUNK_SIZE, sizeof(uint8_t));
-    int64_t *percentiles = calloc(N_PERCENTILES, sizeof(int64_t));
-
-    if (!before_ticks || !after_ticks || !exec_times || !classes ||
-        !input_data || !percentiles) {
-        die();
-    }
-
+    memset(before_ticks, 0, sizeof(before_ticks));
+    memset(after_ticks, 0, sizeof(after_ticks));
     prepare_inputs(input_data, classes);
 
     bool ret = measure(before_ticks, after_ticks, input_data, mode);
     differentiate(exec_times, before_ticks, after_ticks);
     prepare_percentiles(exec_times, percentiles);
     update_statistics(exec_times, classes, percentiles);
-    ret &= report();
-
-    free(before_ticks);
-    free(after_ticks);
-    free(exec_times);
-    free(classes);
-    free(input_data);
-    free(percentiles);
     return ret;
 }
 
@@ -179,22 +231,208 @@ static void init_once(void)
         t_init(ttest_ctxs[i]);
 }
 
+/* Pin the calling process to the nth CPU it is allowed to run on */
+static void pin_worker(int nth)
+{
+#if defined(__linux__)
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed))
+        return;
+    int ncpu = CPU_COUNT(&allowed);
+    if (ncpu <= 1)
+        return;
+
+    nth %= ncpu;
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, &allowed) && nth-- == 0) {
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            CPU_SET(cpu, &set);
+            sched_setaffinity(0, sizeof(set), &set);
+            return;
+        }
+    }
+#else
+    (void) nth;
+#endif
+}
+
+static bool write_all(int fd, const void *buf, size_t len)
+{
+    const char *p = buf;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n <= 0)
+            return false;
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+static bool read_all(int fd, void *buf, size_t len)
+{
+    char *p = buf;
+    while (len > 0) {
+        ssize_t n = read(fd, p, len);
+        if (n <= 0)
+            return false;
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+/* Run rounds batches split over workers processes and merge their statistics
+ * into ttest_ctxs.  Return false if any batch saw a wrong result or a worker
+ * could not report back.
+ */
+static bool doit_parallel(int mode, int rounds, int workers)
+{
+    pid_t pids[MAX_WORKERS];
+    int fds[MAX_WORKERS];
+    int started = 0;
+    bool ok = true;
+
+    /* Do not let the workers inherit pending output */
+    fflush(stdout);
+
+    for (int w = 0; w < workers; w++) {
+        int share = rounds / workers + (w < rounds % workers);
+        int fd[2];
+        if (pipe(fd))
+            break;
+
+        pid_t pid = fork();
+        if (pid < 0) {
+            close(fd[0]);
+            close(fd[1]);
+            break;
+        }
+
+        if (pid == 0) {
+            worker_result_t res = {.ok = true};
+            close(fd[0]);
+            pin_worker(w);
+            /* Per-process counters must be reopened for this process */
+            res.ok = cpucycles_select(cpucycles_backend);
+            /* Only send back what this worker measured */
+            for (size_t i = 0; i < N_TESTS; i++)
+                t_init(ttest_ctxs[i]);
+            for (int i = 0; i < share; i++)
+                res.ok &= doit(mode);
+            for (size_t i = 0; i < N_TESTS; i++)
+                res.ctxs[i] = *ttest_ctxs[i];
+            _exit(write_all(fd[1], &res, sizeof(res)) ? 0 : 1);
+        }
+
+        close(fd[1]);
+        pids[started] = pid;
+        fds[started] = fd[0];
+        started++;
+    }
+
+    /* Measure here whatever could not be handed to a worker */
+    for (int w = started; w < workers; w++) {
+        int share = rounds / workers + (w < rounds % workers);
+        for (int i = 0; i < share; i++)
+            ok &= doit(mode);
+    }
+
+    for (int w = 0; w < started; w++) {
+        worker_result_t res;
+        if (read_all(fds[w], &res, sizeof(res))) {
+            ok &= res.ok;
+            for (size_t i = 0; i < N_TESTS; i++)
+                t_merge(ttest_ctxs[i], &res.ctxs[i]);
+        } else {
+            ok = false;
+        }
+        close(fds[w]);
+        waitpid(pids[w], NULL, 0);
+    }
+
+    return ok;
+}
+
+typedef enum {
+    UNDECIDED,
+    NOT_CONSTANT,
+    CONVERGED,
+} decision_t;
+
+/* Sequential decision of the adaptive mode */
+static decision_t decide(double *measures)
+{
+    t_context_t *t = max_test();
+    *measures = t->n[0] + t->n[1];
+    if (*measures < ENOUGH_MEASURE)
+        return UNDECIDED;
+
+    double max_t = fabs(t_compute(t));
+    if (max_t > t_threshold_decisive)
+        return NOT_CONSTANT;
+    if (max_t * sqrt(MAX_MEASURE / *measures) < t_threshold_moderate)
+        return CONVERGED;
+    return UNDECIDED;
+}
+
+static bool test_const_adaptive(char *text, int mode, int workers)
+{
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    printf("Testing %s...\n\n", text);
+    init_once();
+
+    bool ok = true, result = false;
+    decision_t decision = UNDECIDED;
+    double measures = 0;
+    while (ok && decision == UNDECIDED && measures < MAX_MEASURE) {
+        ok &= workers > 1 ? doit_parallel(mode, workers, workers) : doit(mode);
+        result = report() && ok;
+        decision = decide(&measures);
+    }
+    printf("\033[A\033[2K\033[A\033[2K");
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double elapsed =
+        (end.tv_sec - start.tv_sec) + 1e-9 * (end.tv_nsec - start.tv_nsec);
+    printf("%s: %s after %.0f measurements in %.3f s\n", text,
+           result ? "passed" : "failed", measures, elapsed);
+    return result;
+}
+
 static bool test_const(char *text, int mode)
 {
     bool result = false;
+    int rounds = ENOUGH_MEASURE / (N_MEASURES - DROP_SIZE * 2) + 1;
+    int workers = dudect_workers;
+    if (workers > MAX_WORKERS)
+        workers = MAX_WORKERS;
+
     for (size_t i = 0; i < N_TESTS; i++)
         ttest_ctxs[i] = malloc(sizeof(t_context_t));
 
-    for (int cnt = 0; cnt < TEST_TRIES; ++cnt) {
+    for (int cnt = 0; !dudect_adaptive && cnt < TEST_TRIES; ++cnt) {
         printf("Testing %s...(%d/%d)\n\n", text, cnt, TEST_TRIES);
         init_once();
-        for (int i = 0; i < ENOUGH_MEASURE / (N_MEASURES - DROP_SIZE * 2) + 1;
-             ++i)
-            result = doit(mode);
+        if (workers > 1) {
+            bool ok = doit_parallel(mode, rounds, workers);
+            result = report() && ok;
+        } else {
+            for (int i = 0; i < rounds; ++i) {
+                bool ok = doit(mode);
+                result = report() && ok;
+            }
+        }
         printf("\033[A\033[2K\033[A\033[2K");
         if (result)
             break;
     }
+    if (dudect_adaptive)
+        result = test_const_adaptive(text, mode, workers);
+
     for (size_t i = 0; i < N_TESTS; i++)
         free(ttest_ctxs[i]);
     return result;
@@ -4,6 +4,16 @@
 #include <stdbool.h>
 #include "constant.h"
 
+/* Number of worker processes measuring in parallel, pinned to distinct cores.
+ * 1 measures in the calling process.
+ */
+extern int dudect_workers;
+
+/* Nonzero to stop measuring as soon as the verdict is clear, and report how
+ * long it took to get there.
+ */
+extern int dudect_adaptive;
+
 /* Interface to test if function is constant */
 #define _(x) bool is_##x##_const(void);
 DUT_FUNCS
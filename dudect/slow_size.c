@@ -0,0 +1,17 @@
+/* A q_size which is deliberately quadratic, linked in place of the one in
+ * queue.c by 'make check-dudect' to make sure the complexity test still tells
+ * it apart.  queue.c is then compiled with its q_size renamed q_size_linear.
+ */
+
+#include "queue.h"
+
+int q_size_linear(struct list_head *head);
+
+int q_size(struct list_head *head)
+{
+    /* One more walk of the queue per 16 elements keeps the check quick */
+    int n = q_size_linear(head);
+    for (int i = 0; i < n; i += 16)
+        q_size_linear(head);
+    return n;
+}
@@ -38,6 +38,25 @@ double t_compute(t_context_t *ctx)
     return t_value;
 }
 
+/* Combine the statistics gathered separately in src into dst, as if every
+ * sample of src had been pushed into dst.
+ *
+ * See https://en.wikipedia.org/wiki/Algorithms_for_calculating_variance
+ */
+void t_merge(t_context_t *dst, const t_context_t *src)
+{
+    for (int class = 0; class < 2; class ++) {
+        double n = dst->n[class] + src->n[class];
+        if (n == 0)
+            continue;
+        double delta = src->mean[class] - dst->mean[class];
+        dst->mean[class] += delta * src->n[class] / n;
+        dst->m2[class] += src->m2[class] +
+                          delta * delta * dst->n[class] * src->n[class] / n;
+        dst->n[class] = n;
+    }
+}
+
 void t_init(t_context_t *ctx)
 {
     for (int class = 0; class < 2; class ++) {
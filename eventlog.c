@@ -0,0 +1,168 @@
+/* Binary log of the interpreted commands, see eventlog.h */
+
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#define INTERNAL 1
+#include "eventlog.h"
+#include "harness.h"
+#include "report.h"
+
+#define SEGMENT_SIZE (1 << 20)
+#define ALIGN(n) (((n) + 7) & ~(size_t) 7)
+
+static int log_fd = -1;
+static char *segment; /* mapping of the current segment */
+static size_t seg_index;
+static size_t seg_pos; /* where the next record goes in it */
+static uint64_t log_start;
+static int depth;
+
+static uint64_t now(clockid_t clock)
+{
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Extend the file by a segment and map it */
+static bool map_segment(size_t index)
+{
+    off_t offset = (off_t) index * SEGMENT_SIZE;
+    if (ftruncate(log_fd, offset + SEGMENT_SIZE))
+        return false;
+    void *p = mmap(NULL, SEGMENT_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED,
+                   log_fd, offset);
+    if (p == MAP_FAILED)
+        return false;
+    segment = p;
+    seg_index = index;
+    seg_pos = 0;
+    return true;
+}
+
+static void close_log(void)
+{
+    if (log_fd < 0)
+        return;
+    if (segment) {
+        munmap(segment, SEGMENT_SIZE);
+        segment = NULL;
+        /* Drop the unused rest of the last segment */
+        if (ftruncate(log_fd, (off_t) seg_index * SEGMENT_SIZE + seg_pos)) {
+            /* The reader stops at the zeroes */
+        }
+    }
+    close(log_fd);
+    log_fd = -1;
+}
+
+bool eventlog_open(const char *file_name)
+{
+    static bool registered = false;
+    close_log();
+    if (!file_name)
+        return true;
+    if (!registered) {
+        atexit(close_log);
+        registered = true;
+    }
+
+    log_fd = open(file_name, O_RDWR | O_CREAT | O_TRUNC, 0666);
+    if (log_fd < 0)
+        return false;
+    if (!map_segment(0)) {
+        close(log_fd);
+        log_fd = -1;
+        return false;
+    }
+
+    eventlog_header_t *h = (eventlog_header_t *) segment;
+    memcpy(h->magic, EVENTLOG_MAGIC, sizeof(h->magic));
+    h->header_size = ALIGN(sizeof(*h));
+    h->segment_size = SEGMENT_SIZE;
+    h->start_time = now(CLOCK_REALTIME);
+    seg_pos = h->header_size;
+    log_start = time_ns();
+    depth = 0;
+    return true;
+}
+
+static void read_counters(eventlog_mark_t *mark)
+{
+    alloc_stats_t stats;
+    allocation_stats(&stats);
+    mark->blocks = stats.blocks;
+    mark->bytes = stats.bytes;
+    mark->allocs = stats.allocs;
+    mark->frees = stats.frees;
+}
+
+void eventlog_begin(eventlog_mark_t *mark)
+{
+    mark->active = log_fd >= 0;
+    if (!mark->active)
+        return;
+    depth++;
+    read_counters(mark);
+    /* Last, so that reading the counters is not part of the command */
+    mark->start = time_ns();
+}
+
+void eventlog_end(const eventlog_mark_t *mark,
+                  int argc,
+                  char *argv[],
+                  bool ok)
+{
+    if (!mark->active)
+        return;
+    uint64_t end = time_ns();
+    eventlog_mark_t after;
+    read_counters(&after);
+    if (depth)
+        depth--;
+
+    /* Logging was stopped or restarted by the command */
+    if (log_fd < 0 || mark->start < log_start)
+        return;
+
+    size_t size = sizeof(eventlog_record_t);
+    for (int i = 0; i < argc; i++)
+        size += strlen(argv[i]) + 1;
+    size = ALIGN(size);
+    if (size > SEGMENT_SIZE)
+        return;
+    if (seg_pos + size > SEGMENT_SIZE) {
+        munmap(segment, SEGMENT_SIZE);
+        segment = NULL;
+        if (!map_segment(seg_index + 1)) {
+            close_log();
+            return;
+        }
+    }
+
+    eventlog_record_t *r = (eventlog_record_t *) (segment + seg_pos);
+    r->size = size;
+    r->argc = argc;
+    r->ok = ok;
+    r->depth = depth;
+    r->start = mark->start - log_start;
+    r->duration = end - mark->start;
+    r->blocks = after.blocks - mark->blocks;
+    r->bytes = after.bytes - mark->bytes;
+    r->allocs = after.allocs - mark->allocs;
+    r->frees = after.frees - mark->frees;
+
+    char *p = (char *) (r + 1);
+    for (int i = 0; i < argc; i++) {
+        size_t len = strlen(argv[i]) + 1;
+        memcpy(p, argv[i], len);
+        p += len;
+    }
+    seg_pos += size;
+}
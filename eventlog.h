@@ -0,0 +1,58 @@
+#ifndef LAB0_EVENTLOG_H
+#define LAB0_EVENTLOG_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Binary log of the interpreted commands, for offline analysis with
+ * scripts/eventlog.py.
+ *
+ * The file starts with an eventlog_header_t and is written in segments of
+ * 'segment_size' bytes, each memory-mapped in turn.  Records are 8-byte
+ * aligned and never cross a segment; a record size of 0 marks the unused rest
+ * of a segment.  A record is an eventlog_record_t followed by its 'argc'
+ * arguments, each terminated by a NUL byte.  All fields are in host byte
+ * order.
+ */
+
+#define EVENTLOG_MAGIC "QTEVLOG1"
+
+typedef struct {
+    char magic[8];
+    uint32_t header_size;  /* bytes before the first record */
+    uint32_t segment_size; /* the header is part of the first segment */
+    uint64_t start_time;   /* when logging started, ns since the epoch */
+} eventlog_header_t;
+
+typedef struct {
+    uint32_t size;  /* of the whole record, padding included */
+    uint16_t argc;
+    uint8_t ok;     /* the command succeeded */
+    uint8_t depth;  /* 0, or 1 and more for commands run by commands */
+    uint64_t start; /* ns since logging started */
+    uint64_t duration;
+    int64_t blocks; /* change in blocks allocated by the tested code */
+    int64_t bytes;  /* change in their payload bytes */
+    uint64_t allocs; /* allocations made by the tested code */
+    uint64_t frees;
+} eventlog_record_t;
+
+/* State kept by the interpreter while a command runs */
+typedef struct {
+    bool active; /* logging when the command started */
+    uint64_t start;
+    int64_t blocks, bytes;
+    uint64_t allocs, frees;
+} eventlog_mark_t;
+
+/* Start logging to file_name, replacing what it held, or stop with NULL */
+bool eventlog_open(const char *file_name);
+
+/* Call around each command */
+void eventlog_begin(eventlog_mark_t *mark);
+void eventlog_end(const eventlog_mark_t *mark,
+                  int argc,
+                  char *argv[],
+                  bool ok);
+
+#endif /* LAB0_EVENTLOG_H */
@@ -8,6 +8,7 @@
 #include <string.h>
 #include <unistd.h>
 
+#include "random.h"
 #include "report.h"
 
 /* Our program needs to use regular malloc/free */
@@ -43,10 +44,40 @@ typedef struct __block_element {
 
 static block_element_t *allocated = NULL;
 static size_t allocated_count = 0;
+static size_t allocated_bytes = 0, peak_bytes = 0;
+static unsigned long alloc_total = 0, free_total = 0;
 
 /* Percent probability of malloc failure */
 int fail_probability = 0;
 
+/* Deterministic fault injection.
+ * Every allocation gets a serial number counted since the last fault_reset().
+ * Whether it fails depends only on that number, the seed and the schedule, so
+ * the same sequence of commands reproduces the same failures.
+ */
+int fail_seed = 0;
+int fail_nth = 0;
+
+#define MAX_SITE 64
+
+static unsigned long alloc_serial = 0;
+static uintptr_t fault_state = 0;
+static uintptr_t fault_seed_used = 0;
+static bool fault_seeded = false;
+static char fault_site[MAX_SITE] = "";
+
+/* Explicit list of allocations to fail, in ascending order */
+static unsigned long fault_schedule[MAX_SCHEDULE];
+static int fault_schedule_cnt = 0;
+static int fault_schedule_next = 0;
+
+/* Record of injected failures, used to replay a run */
+static struct {
+    unsigned long serial;
+    const char *site;
+} fault_log[MAX_SCHEDULE];
+static unsigned long fault_cnt = 0;
+
 static bool cautious_mode = true;
 static bool noallocate_mode = false;
 static bool error_occurred = false;
@@ -67,11 +98,62 @@ typedef enum {
 
 /* Internal functions */
 
+static void fault_seed()
+{
+    fault_seed_used = (uintptr_t) fail_seed;
+    while (!fault_seed_used)
+        randombytes((uint8_t *) &fault_seed_used, sizeof(fault_seed_used));
+    fault_state = fault_seed_used;
+    fault_seeded = true;
+}
+
+/* Next value of the fault injection generator (splitmix) */
+static uintptr_t fault_random()
+{
+    if (!fault_seeded)
+        fault_seed();
+    fault_state += (uintptr_t) 0x9e3779b97f4a7c15ULL;
+    return random_shuffle(fault_state);
+}
+
 /* Should this allocation fail? */
-static bool fail_allocation()
+static bool fail_allocation(const char *site)
 {
-    double weight = (double) random() / RAND_MAX;
-    return (weight < 0.01 * fail_probability);
+    unsigned long serial = ++alloc_serial;
+
+    /* Keep the common case, no fault injection at all, cheap */
+    if (!fail_probability && !fail_nth &&
+        fault_schedule_next >= fault_schedule_cnt)
+        return false;
+
+    if (fault_site[0] && (!site || strcmp(site, fault_site)))
+        return false;
+
+    bool fail = false;
+    if (fault_schedule_cnt) {
+        /* A replayed schedule fails exactly the allocations it names, so
+         * 'option malloc' and 'option malloc_nth' are left out until reset.
+         */
+        while (fault_schedule_next < fault_schedule_cnt &&
+               fault_schedule[fault_schedule_next] <= serial) {
+            if (fault_schedule[fault_schedule_next++] == serial)
+                fail = true;
+        }
+    } else {
+        if (fail_nth > 0)
+            fail = serial % fail_nth == 0;
+        if (!fail && fail_probability > 0)
+            fail = fault_random() % 100 < (uintptr_t) fail_probability;
+    }
+
+    if (fail) {
+        if (fault_cnt < MAX_SCHEDULE) {
+            fault_log[fault_cnt].serial = serial;
+            fault_log[fault_cnt].site = site;
+        }
+        fault_cnt++;
+    }
+    return fail;
 }
 
 /* Find header of block, given its payload.
@@ -122,7 +204,7 @@ static size_t *find_footer(block_element_t *b)
     return p;
 }
 
-static void *alloc(alloc_t alloc_type, size_t size)
+static void *alloc(alloc_t alloc_type, size_t size, const char *site)
 {
     if (noallocate_mode) {
         char *msg_alloc_forbidden[] = {
@@ -133,12 +215,14 @@ static void *alloc(alloc_t alloc_type, size_t size)
         return NULL;
     }
 
-    if (fail_allocation()) {
+    if (fail_allocation(site)) {
         char *msg_alloc_failure[] = {
             "Malloc returning NULL",
             "Calloc returning NULL",
         };
-        report_event(MSG_WARN, "%s", msg_alloc_failure[alloc_type]);
+        report_event(MSG_WARN, "%s (allocation #%lu in %s)",
+                     msg_alloc_failure[alloc_type], alloc_serial,
+                     site ? site : "?");
         return NULL;
     }
 
@@ -165,6 +249,10 @@ static void *alloc(alloc_t alloc_type, size_t size)
         allocated->prev = new_block;
     allocated = new_block;
     allocated_count++;
+    allocated_bytes += size;
+    if (allocated_bytes > peak_bytes)
+        peak_bytes = allocated_bytes;
+    alloc_total++;
 
     return p;
 }
@@ -173,18 +261,28 @@ static void *alloc(alloc_t alloc_type, size_t size)
 
 void *test_malloc(size_t size)
 {
-    return alloc(TEST_MALLOC, size);
+    return alloc(TEST_MALLOC, size, NULL);
+}
+
+void *test_malloc_at(size_t size, const char *site)
+{
+    return alloc(TEST_MALLOC, size, site);
 }
 
 // cppcheck-suppress unusedFunction
 void *test_calloc(size_t nelem, size_t elsize)
+{
+    return test_calloc_at(nelem, elsize, NULL);
+}
+
+void *test_calloc_at(size_t nelem, size_t elsize, const char *site)
 {
     /* Reference: Malloc tutorial
      * https://danluu.com/malloc-tutorial/
      */
     if (!nelem || !elsize || nelem > SIZE_MAX / elsize)
         return NULL;
-    return alloc(TEST_CALLOC, nelem * elsize);
+    return alloc(TEST_CALLOC, nelem * elsize, site);
 }
 
 void test_free(void *p)
@@ -220,15 +318,22 @@ void test_free(void *p)
     if (bn)
         bn->prev = bp;
 
+    allocated_bytes -= b->payload_size;
     free(b);
     allocated_count--;
+    free_total++;
 }
 
 // cppcheck-suppress unusedFunction
 char *test_strdup(const char *s)
+{
+    return test_strdup_at(s, NULL);
+}
+
+char *test_strdup_at(const char *s, const char *site)
 {
     size_t len = strlen(s) + 1;
-    void *new = test_malloc(len);
+    void *new = alloc(TEST_MALLOC, len, site);
     if (!new)
         return NULL;
 
@@ -240,6 +345,15 @@ size_t allocation_check()
     return allocated_count;
 }
 
+void allocation_stats(alloc_stats_t *stats)
+{
+    stats->blocks = allocated_count;
+    stats->bytes = allocated_bytes;
+    stats->peak_bytes = peak_bytes;
+    stats->allocs = alloc_total;
+    stats->frees = free_total;
+}
+
 /* Implementation of functions for testing */
 
 /* Set/unset cautious mode.
@@ -258,6 +372,68 @@ void set_noallocate_mode(bool noallocate)
     noallocate_mode = noallocate;
 }
 
+void fault_reset()
+{
+    alloc_serial = 0;
+    fault_cnt = 0;
+    fault_schedule_cnt = 0;
+    fault_schedule_next = 0;
+    fault_seed();
+}
+
+bool fault_set_site(const char *site)
+{
+    if (!site) {
+        fault_site[0] = '\0';
+        return true;
+    }
+    if (strlen(site) >= MAX_SITE)
+        return false;
+    strncpy(fault_site, site, MAX_SITE);
+    return true;
+}
+
+bool fault_set_schedule(const unsigned long *serials, int cnt)
+{
+    if (cnt < 0 || cnt > MAX_SCHEDULE)
+        return false;
+    for (int i = 1; i < cnt; i++) {
+        if (serials[i] <= serials[i - 1])
+            return false;
+    }
+
+    fault_reset();
+    memcpy(fault_schedule, serials, cnt * sizeof(unsigned long));
+    fault_schedule_cnt = cnt;
+    return true;
+}
+
+void fault_show(int vlevel)
+{
+    if (!fault_seeded)
+        fault_seed();
+
+    report(vlevel, "Fault seed = %lu, allocations = %lu, failures = %lu",
+           (unsigned long) fault_seed_used, alloc_serial, fault_cnt);
+    if (fault_site[0])
+        report(vlevel, "Failures restricted to %s", fault_site);
+    if (!fault_cnt)
+        return;
+
+    unsigned long cnt = fault_cnt < MAX_SCHEDULE ? fault_cnt : MAX_SCHEDULE;
+    for (unsigned long i = 0; i < cnt; i++) {
+        report(vlevel, "  #%lu in %s", fault_log[i].serial,
+               fault_log[i].site ? fault_log[i].site : "?");
+    }
+    if (fault_cnt > cnt)
+        report(vlevel, "  (%lu more not recorded)", fault_cnt - cnt);
+
+    report_noreturn(vlevel, "Replay with: fault at");
+    for (unsigned long i = 0; i < cnt; i++)
+        report_noreturn(vlevel, " %lu", fault_log[i].serial);
+    report(vlevel, "");
+}
+
 /* Return whether any errors have occurred since last time set error limit */
 bool error_check()
 {
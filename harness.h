@@ -16,14 +16,63 @@ void test_free(void *p);
 char *test_strdup(const char *s);
 /* FIXME: provide test_realloc as well */
 
+/* Same as above, but tag the allocation with the name of the calling function
+ * so that fault injection can be restricted to a call site.
+ */
+void *test_malloc_at(size_t size, const char *site);
+void *test_calloc_at(size_t nmemb, size_t size, const char *site);
+char *test_strdup_at(const char *s, const char *site);
+
 #ifdef INTERNAL
 
 /* Report number of allocated blocks */
 size_t allocation_check();
 
+/* Counters of the allocations made through the harness */
+typedef struct {
+    size_t blocks;         /* currently allocated */
+    size_t bytes;          /* their payload */
+    size_t peak_bytes;     /* most payload allocated at once */
+    unsigned long allocs;  /* successful allocations so far */
+    unsigned long frees;   /* blocks freed so far */
+} alloc_stats_t;
+
+void allocation_stats(alloc_stats_t *stats);
+
 /* Probability of malloc failing, expressed as percent */
 extern int fail_probability;
 
+/* Seed of the fault injection generator, 0 picks a random one */
+extern int fail_seed;
+
+/* Fail every Nth allocation, 0 to disable */
+extern int fail_nth;
+
+/* Restart the fault injection schedule.
+ * Allocation numbers are counted from this point, the generator is reseeded
+ * and the record of injected failures is cleared.
+ */
+void fault_reset();
+
+/* Restrict fault injection to allocations made by function site.
+ * NULL or empty string removes the restriction.
+ */
+bool fault_set_site(const char *site);
+
+/* Most allocations a schedule can name, and most failures recorded */
+#define MAX_SCHEDULE 64
+
+/* Fail exactly the allocations numbered in serials (counted since the last
+ * reset, which this function performs).  Used to replay a recorded schedule:
+ * until the next reset, fail_probability and fail_nth fail nothing.
+ */
+bool fault_set_schedule(const unsigned long *serials, int cnt);
+
+/* Report the state of fault injection and the failures injected so far in a
+ * form that can be fed back through the 'fault' command.
+ */
+void fault_show(int vlevel);
+
 /*
  * Set/unset cautious mode.
  * In this mode, makes extra sure any block to be freed is currently allocated.
@@ -54,13 +103,13 @@ void trigger_exception(char *msg);
 #else /* !INTERNAL */
 
 /* Tested program use our versions of malloc and free */
-#define malloc test_malloc
-#define calloc test_calloc
+#define malloc(size) test_malloc_at(size, __func__)
+#define calloc(nmemb, size) test_calloc_at(nmemb, size, __func__)
 #define free test_free
 
 /* Use undef to avoid strdup redefined error */
 #undef strdup
-#define strdup test_strdup
+#define strdup(s) test_strdup_at(s, __func__)
 
 #endif
 
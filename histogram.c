@@ -0,0 +1,70 @@
+#include <string.h>
+
+#include "histogram.h"
+
+#define SUB (1 << HIST_SUB_BITS)
+
+static inline int bucket_of(uint64_t value)
+{
+    if (value < SUB)
+        return value;
+    int msb = 63 - __builtin_clzll(value);
+    if (msb >= HIST_MAX_BITS)
+        return HIST_BUCKETS - 1;
+    int shift = msb - HIST_SUB_BITS;
+    return ((shift + 1) << HIST_SUB_BITS) + (int) (value >> shift) - SUB;
+}
+
+/* Middle of the values counted in a bucket */
+static uint64_t bucket_value(int index)
+{
+    if (index < SUB)
+        return index;
+    int shift = (index >> HIST_SUB_BITS) - 1;
+    uint64_t low = (uint64_t) (index % SUB + SUB) << shift;
+    return low + (((uint64_t) 1 << shift) >> 1);
+}
+
+void hist_reset(histogram_t *h)
+{
+    memset(h, 0, sizeof(*h));
+}
+
+void hist_add(histogram_t *h, uint64_t value)
+{
+    if (!h->count || value < h->min)
+        h->min = value;
+    if (value > h->max)
+        h->max = value;
+    h->count++;
+    h->sum += value;
+    h->buckets[bucket_of(value)]++;
+}
+
+uint64_t hist_percentile(const histogram_t *h, double p)
+{
+    if (!h->count)
+        return 0;
+
+    /* Rank of the value sought, counting from 1 */
+    uint64_t rank = (uint64_t) (p * h->count + 0.5);
+    if (rank < 1)
+        rank = 1;
+    if (rank > h->count)
+        rank = h->count;
+
+    uint64_t seen = 0;
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        seen += h->buckets[i];
+        if (seen >= rank) {
+            uint64_t v = bucket_value(i);
+            /* The exact extremes are known */
+            if (v < h->min)
+                v = h->min;
+            if (v > h->max)
+                v = h->max;
+            return v;
+        }
+    }
+    return h->max;
+}
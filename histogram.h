@@ -0,0 +1,31 @@
+#ifndef LAB0_HISTOGRAM_H
+#define LAB0_HISTOGRAM_H
+
+#include <stdint.h>
+
+/* Latency histogram in the manner of HdrHistogram: values below
+ * 2^HIST_SUB_BITS are counted exactly, larger ones in buckets whose width is
+ * 1/2^HIST_SUB_BITS of their magnitude, so any percentile is within about
+ * 1.6% of the true value.  Values up to 2^HIST_MAX_BITS (about 39 hours in
+ * ns) are told apart, longer ones fall into the last bucket.
+ */
+#define HIST_SUB_BITS 6
+#define HIST_MAX_BITS 47
+#define HIST_BUCKETS ((HIST_MAX_BITS - HIST_SUB_BITS + 1) << HIST_SUB_BITS)
+
+typedef struct {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t min;
+    uint64_t max;
+    uint32_t buckets[HIST_BUCKETS];
+} histogram_t;
+
+void hist_reset(histogram_t *h);
+
+void hist_add(histogram_t *h, uint64_t value);
+
+/* Value below which the fraction p (0 to 1) of the values fall, 0 if empty */
+uint64_t hist_percentile(const histogram_t *h, double p);
+
+#endif /* LAB0_HISTOGRAM_H */
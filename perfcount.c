@@ -0,0 +1,107 @@
+#include <string.h>
+#include <unistd.h>
+
+#include "perfcount.h"
+
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+
+const char *perf_counter_names[PC_N] = {
+    "cycles", "instructions", "cache_misses", "branch_misses", "dtlb_misses",
+};
+
+#if defined(__linux__)
+
+static const struct {
+    uint32_t type;
+    uint64_t config;
+} events[PC_N] = {
+    [PC_CYCLES] = {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+    [PC_INSTRUCTIONS] = {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+    [PC_CACHE_MISSES] = {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+    [PC_BRANCH_MISSES] = {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+    [PC_DTLB_MISSES] = {PERF_TYPE_HW_CACHE,
+                        PERF_COUNT_HW_CACHE_DTLB |
+                            (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                            (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)},
+};
+
+bool perf_open(perf_counters_t *pc)
+{
+    bool any = false;
+    for (int i = 0; i < PC_N; i++) {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = events[i].type;
+        attr.config = events[i].config;
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format =
+            PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        pc->fd[i] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+        pc->value[i] = 0;
+        any = any || pc->fd[i] >= 0;
+    }
+    return any;
+}
+
+void perf_start(perf_counters_t *pc)
+{
+    for (int i = 0; i < PC_N; i++) {
+        if (pc->fd[i] < 0)
+            continue;
+        ioctl(pc->fd[i], PERF_EVENT_IOC_RESET, 0);
+        ioctl(pc->fd[i], PERF_EVENT_IOC_ENABLE, 0);
+    }
+}
+
+void perf_stop(perf_counters_t *pc)
+{
+    for (int i = 0; i < PC_N; i++) {
+        if (pc->fd[i] >= 0)
+            ioctl(pc->fd[i], PERF_EVENT_IOC_DISABLE, 0);
+    }
+    for (int i = 0; i < PC_N; i++) {
+        /* value, time enabled, time running */
+        uint64_t buf[3];
+        pc->value[i] = 0;
+        if (pc->fd[i] < 0 || read(pc->fd[i], buf, sizeof(buf)) != sizeof(buf))
+            continue;
+        if (buf[2] && buf[2] < buf[1])
+            buf[0] = (double) buf[0] * buf[1] / buf[2];
+        pc->value[i] = buf[0];
+    }
+}
+
+void perf_close(perf_counters_t *pc)
+{
+    for (int i = 0; i < PC_N; i++) {
+        if (pc->fd[i] >= 0)
+            close(pc->fd[i]);
+        pc->fd[i] = -1;
+    }
+}
+
+#else /* !__linux__ */
+
+bool perf_open(perf_counters_t *pc)
+{
+    for (int i = 0; i < PC_N; i++) {
+        pc->fd[i] = -1;
+        pc->value[i] = 0;
+    }
+    return false;
+}
+
+void perf_start(perf_counters_t *pc) {}
+
+void perf_stop(perf_counters_t *pc) {}
+
+void perf_close(perf_counters_t *pc) {}
+
+#endif
@@ -0,0 +1,46 @@
+#ifndef LAB0_PERFCOUNT_H
+#define LAB0_PERFCOUNT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Hardware performance counters of the calling thread, through Linux
+ * perf_event_open.  Each counter is opened on its own, so one the CPU or
+ * the kernel does not offer (common in virtual machines, or with a strict
+ * perf_event_paranoid) is simply left out; without any, the callers report
+ * timing only.  Only user space is counted.
+ */
+typedef enum {
+    PC_CYCLES,
+    PC_INSTRUCTIONS,
+    PC_CACHE_MISSES,
+    PC_BRANCH_MISSES,
+    PC_DTLB_MISSES,
+    PC_N,
+} perf_counter_t;
+
+extern const char *perf_counter_names[PC_N];
+
+typedef struct {
+    int fd[PC_N];         /* -1 when not available */
+    uint64_t value[PC_N]; /* counted between the last start and stop */
+} perf_counters_t;
+
+/* Return false if no counter could be opened */
+bool perf_open(perf_counters_t *pc);
+
+void perf_start(perf_counters_t *pc);
+
+/* Stop counting and read the values, scaled up if the kernel had to share
+ * the hardware counters with others
+ */
+void perf_stop(perf_counters_t *pc);
+
+static inline bool perf_has(const perf_counters_t *pc, perf_counter_t c)
+{
+    return pc->fd[c] >= 0;
+}
+
+void perf_close(perf_counters_t *pc);
+
+#endif /* LAB0_PERFCOUNT_H */
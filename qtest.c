@@ -19,6 +19,7 @@
 #include <time.h>
 #endif
 
+#include "dudect/cpucycles.h"
 #include "dudect/fixture.h"
 #include "list.h"
 #include "list_sort.h"
@@ -50,6 +51,7 @@ extern int show_entropy;
 
 #include "console.h"
 #include "report.h"
+#include "runner.h"
 
 /* Settable parameters */
 
@@ -186,24 +188,42 @@ static void fill_rand_string(char *buf, size_t buf_size)
     buf[len] = '\0';
 }
 
+/* Run the dudect test of an operation instead of the operation itself.
+ * expect describes the complexity the test checks for.
+ */
+static bool simulate(int argc,
+                     char *argv[],
+                     bool (*is_const)(void),
+                     const char *expect)
+{
+    if (argc != 1) {
+        report(1, "%s does not need arguments in simulation mode", argv[0]);
+        return false;
+    }
+
+    /* The tests free their queues out of allocation order, and print their
+     * progress through stdio.
+     */
+    report_flush();
+    set_cautious_mode(false);
+    bool ok = is_const();
+    set_cautious_mode(true);
+    if (!ok) {
+        report(1, "ERROR: Probably not %s or wrong implementation", expect);
+        return false;
+    }
+    report(1, "Probably %s", expect);
+    return ok;
+}
+
 /* insertion */
 static bool queue_insert(position_t pos, int argc, char *argv[])
 {
-    if (simulation) {
-        if (argc != 1) {
-            report(1, "%s does not need arguments in simulation mode", argv[0]);
-            return false;
-        }
-        bool ok =
-            pos == POS_TAIL ? is_insert_tail_const() : is_insert_head_const();
-        if (!ok) {
-            report(1,
-                   "ERROR: Probably not constant time or wrong implementation");
-            return false;
-        }
-        report(1, "Probably constant time");
-        return ok;
-    }
+    if (simulation)
+        return simulate(argc, argv,
+                        pos == POS_TAIL ? is_insert_tail_const
+                                        : is_insert_head_const,
+                        "constant time");
 
     char *lasts = NULL;
     char randstr_buf[MAX_RANDSTR_LEN];
@@ -301,21 +321,11 @@ static bool queue_remove(position_t pos, int argc, char *argv[])
      * We shall figure out the exact reasons and resolve later.
      */
 #if !(defined(__aarch64__) && defined(__APPLE__))
-    if (simulation) {
-        if (argc != 1) {
-            report(1, "%s does not need arguments in simulation mode", argv[0]);
-            return false;
-        }
-        bool ok =
-            pos == POS_TAIL ? is_remove_tail_const() : is_remove_head_const();
-        if (!ok) {
-            report(1,
-                   "ERROR: Probably not constant time or wrong implementation");
-            return false;
-        }
-        report(1, "Probably constant time");
-        return ok;
-    }
+    if (simulation)
+        return simulate(argc, argv,
+                        pos == POS_TAIL ? is_remove_tail_const
+                                        : is_remove_head_const,
+                        "constant time");
 #endif
 
     if (argc != 1 && argc != 2) {
@@ -323,20 +333,8 @@ static bool queue_remove(position_t pos, int argc, char *argv[])
         return false;
     }
 
-    char *removes = malloc(string_length + STRINGPAD + 1);
-    if (!removes) {
-        report(1,
-               "INTERNAL ERROR.  Could not allocate space for removed strings");
-        return false;
-    }
-
-    char *checks = malloc(string_length + 1);
-    if (!checks) {
-        report(1,
-               "INTERNAL ERROR.  Could not allocate space for removed strings");
-        free(removes);
-        return false;
-    }
+    char *removes = cmd_alloc(string_length + STRINGPAD + 1);
+    char *checks = cmd_alloc(string_length + 1);
 
     bool check = argc > 1;
     bool ok = true;
@@ -408,8 +406,6 @@ static bool queue_remove(position_t pos, int argc, char *argv[])
 
     q_show(3);
 
-    free(removes);
-    free(checks);
     return ok && !error_check();
 }
 
@@ -520,6 +516,9 @@ static bool do_dedup(int argc, char *argv[])
 
 static bool do_reverse(int argc, char *argv[])
 {
+    if (simulation)
+        return simulate(argc, argv, is_reverse_const, "linear time");
+
     if (argc != 1) {
         report(1, "%s takes no arguments", argv[0]);
         return false;
@@ -541,6 +540,9 @@ static bool do_reverse(int argc, char *argv[])
 
 static bool do_size(int argc, char *argv[])
 {
+    if (simulation)
+        return simulate(argc, argv, is_size_const, "linear time");
+
     if (argc != 1 && argc != 2) {
         report(1, "%s takes 0-1 arguments", argv[0]);
         return false;
@@ -584,6 +586,9 @@ static bool do_size(int argc, char *argv[])
 
 bool do_sort(int argc, char *argv[])
 {
+    if (simulation)
+        return simulate(argc, argv, is_sort_const, "linearithmic time");
+
     if (argc != 1) {
         report(1, "%s takes no arguments", argv[0]);
         return false;
@@ -675,6 +680,9 @@ bool do_sort(int argc, char *argv[])
 
 static bool do_dm(int argc, char *argv[])
 {
+    if (simulation)
+        return simulate(argc, argv, is_delete_mid_const, "linear time");
+
     if (argc != 1) {
         report(1, "%s takes no arguments", argv[0]);
         return false;
@@ -701,6 +709,9 @@ static bool do_dm(int argc, char *argv[])
 
 static bool do_swap(int argc, char *argv[])
 {
+    if (simulation)
+        return simulate(argc, argv, is_swap_const, "linear time");
+
     if (argc != 1) {
         report(1, "%s takes no arguments", argv[0]);
         return false;
@@ -1003,6 +1014,91 @@ static bool q_show(int vlevel)
     return ok;
 }
 
+static bool do_fault(int argc, char *argv[])
+{
+    if (argc == 1) {
+        fault_show(1);
+        return true;
+    }
+
+    if (!strcmp(argv[1], "reset") && argc == 2) {
+        fault_reset();
+        return true;
+    }
+
+    if (!strcmp(argv[1], "site") && argc <= 3) {
+        if (!fault_set_site(argc == 3 ? argv[2] : NULL)) {
+            report(1, "Invalid call site '%s'", argv[2]);
+            return false;
+        }
+        return true;
+    }
+
+    if (!strcmp(argv[1], "at")) {
+        unsigned long serials[MAX_SCHEDULE];
+        int cnt = argc - 2;
+        if (cnt > MAX_SCHEDULE) {
+            report(1, "At most %d allocations can be scheduled to fail",
+                   MAX_SCHEDULE);
+            return false;
+        }
+        for (int i = 0; i < cnt; i++) {
+            char *end = NULL;
+            serials[i] = strtoul(argv[i + 2], &end, 0);
+            if (!serials[i] || *end != '\0') {
+                report(1, "Invalid allocation number '%s'", argv[i + 2]);
+                return false;
+            }
+        }
+        if (!fault_set_schedule(serials, cnt)) {
+            report(1, "Allocation numbers must be in ascending order");
+            return false;
+        }
+        return true;
+    }
+
+    report(1, "Unknown fault injection request '%s'", argv[1]);
+    return false;
+}
+
+static void fault_changed(int oldval)
+{
+    fault_reset();
+}
+
+static int timer = CPUCYCLES_TSC_FENCED;
+
+static void timer_changed(int oldval)
+{
+    if (cpucycles_select(timer))
+        return;
+    report(1, "Timer %d (%s) is not available, keeping %s", timer,
+           cpucycles_name(timer), cpucycles_name(oldval));
+    timer = oldval;
+}
+
+static bool do_noise(int argc, char *argv[])
+{
+    if (argc != 1) {
+        report(1, "%s takes no arguments", argv[0]);
+        return false;
+    }
+
+    report(1, "   timer                 min    median    stddev");
+    for (int i = 0; i < N_CPUCYCLES; i++) {
+        int64_t min;
+        double median, stddev;
+        char mark = i == timer ? '*' : ' ';
+        if (!cpucycles_noise(i, &min, &median, &stddev)) {
+            report(1, "%c %d %-17s unavailable", mark, i, cpucycles_name(i));
+            continue;
+        }
+        report(1, "%c %d %-17s %5ld %9.1f %9.1f", mark, i, cpucycles_name(i),
+               (long) min, median, stddev);
+    }
+    return true;
+}
+
 static bool do_show(int argc, char *argv[])
 {
     if (argc != 1) {
@@ -1102,15 +1198,32 @@ static void console_init()
                 "");
     ADD_COMMAND(reverseK, "Reverse the nodes of the queue 'K' at a time",
                 "[K]");
+    ADD_COMMAND(fault,
+                "Show injected malloc failures, restrict them to function "
+                "site, or fail exactly the given allocations",
+                "[op arg ...]");
+    ADD_COMMAND(noise, "Show the noise floor of every measurement timer", "");
     add_param("length", &string_length, "Maximum length of displayed string",
               NULL);
     add_param("malloc", &fail_probability, "Malloc failure probability percent",
               NULL);
+    add_param("malloc_seed", &fail_seed,
+              "Seed of malloc failures, restarts the schedule (0: random)",
+              fault_changed);
+    add_param("malloc_nth", &fail_nth, "Fail every Nth allocation (0: never)",
+              fault_changed);
     add_param("fail", &fail_limit,
               "Number of times allow queue operations to return false", NULL);
     add_param("descend", &descend,
               "Sort and merge queue in ascending/descending order", NULL);
     add_param("sort", &sort, "Specify the sorting algorithm", NULL);
+    add_param("workers", &dudect_workers,
+              "Number of pinned processes measuring in simulation mode", NULL);
+    add_param("adaptive", &dudect_adaptive,
+              "Stop simulation as soon as the verdict is clear", NULL);
+    add_param("timer", &timer,
+              "Timer used in simulation mode (see 'noise' for choices)",
+              timer_changed);
 }
 
 /* Signal handlers */
@@ -1170,13 +1283,123 @@ static bool q_quit(int argc, char *argv[])
     return true;
 }
 
+/* Strings of the queue that 'bench -r' puts back before each run */
+static char **bench_values = NULL;
+static int bench_count = 0, bench_cap = 0;
+
+/* Refill the current queue with the saved strings, creating a queue if the
+ * command freed it.  Injected allocation failures are held off meanwhile.
+ */
+static bool bench_restore()
+{
+    int saved_probability = fail_probability, saved_nth = fail_nth;
+    fail_probability = 0;
+    fail_nth = 0;
+
+    if (!current) {
+        char *argv[] = {"new"};
+        do_new(1, argv);
+    }
+    if (current->size > BIG_LIST_SIZE)
+        set_cautious_mode(false);
+
+    int cnt = 0;
+    if (exception_setup(true)) {
+        q_free(current->q);
+        current->q = q_new();
+        while (current->q && cnt < bench_count &&
+               q_insert_tail(current->q, bench_values[cnt]))
+            cnt++;
+    }
+    exception_cancel();
+    set_cautious_mode(true);
+    current->size = cnt;
+
+    fail_probability = saved_probability;
+    fail_nth = saved_nth;
+
+    if (!current->q || cnt != bench_count) {
+        report(1, "ERROR: Could not restore the queue");
+        return false;
+    }
+    return !error_check();
+}
+
+static bool bench_reset(bench_reset_t what)
+{
+    switch (what) {
+    case BENCH_SAVE:
+        if (!current || !current->q) {
+            report(1, "No queue to restore between runs");
+            return false;
+        }
+        bench_cap = current->size + 1;
+        bench_values = calloc_or_fail(bench_cap, sizeof(char *), "bench_reset");
+        element_t *e;
+        bench_count = 0;
+        list_for_each_entry (e, current->q, list) {
+            if (bench_count == bench_cap)
+                break;
+            bench_values[bench_count++] =
+                strsave_or_fail(e->value, "bench_reset");
+        }
+        return true;
+    case BENCH_RESTORE:
+        return bench_restore();
+    case BENCH_DISCARD:
+        for (int i = 0; i < bench_count; i++)
+            free_string(bench_values[i]);
+        free_array(bench_values, bench_cap, sizeof(char *));
+        bench_values = NULL;
+        bench_count = 0;
+        break;
+    }
+    return true;
+}
+
+/* Seconds a trace may take under --run-traces */
+#define TRACE_TIMEOUT 600
+
+/* Runs of each trace when recording or comparing a baseline */
+#define BASELINE_REPEAT 5
+
+/* Counters of the harness, written at exit for the trace runner */
+static bool write_stats(const char *fname)
+{
+    FILE *f = fopen(fname, "w");
+    if (!f)
+        return false;
+    alloc_stats_t stats;
+    allocation_stats(&stats);
+    fprintf(f, "allocs %lu\nfrees %lu\npeak_bytes %zu\n", stats.allocs,
+            stats.frees, stats.peak_bytes);
+    return fclose(f) == 0;
+}
+
 static void usage(char *cmd)
 {
     printf("Usage: %s [-h] [-f IFILE][-v VLEVEL][-l LFILE]\n", cmd);
+    printf("       %s --run-traces [-j JOBS][-v VLEVEL][--timeout SECS] "
+           "[TID...]\n",
+           cmd);
     printf("\t-h         Print this information\n");
     printf("\t-f IFILE   Read commands from IFILE\n");
     printf("\t-v VLEVEL  Set verbosity level\n");
     printf("\t-l LFILE   Echo results to LFILE\n");
+    printf("\t--run-traces  Score the traces like scripts/driver.py\n");
+    printf("\t-j JOBS    Traces run at once, at most one per CPU (the "
+           "default)\n");
+    printf("\t           Perf and complexity traces run last, one at a time"
+           "\n");
+    printf("\t--timeout SECS  Fail traces running longer (default: %d)\n",
+           TRACE_TIMEOUT);
+    printf("\t--record FILE   Save a performance baseline of the traces, "
+           "one at a time\n");
+    printf("\t--compare FILE  Flag regressions against a saved baseline\n");
+    printf("\t--repeat N      Runs of each trace (default: %d with a baseline)"
+           "\n",
+           BASELINE_REPEAT);
+    printf("\t--stats FILE    Write allocation counters to FILE at exit\n");
     exit(0);
 }
 
@@ -1245,10 +1468,47 @@ int main(int argc, char *argv[])
     char lbuf[BUFSIZE];
     char *logfile_name = NULL;
     int level = 4;
+    bool level_set = false;
+    bool traces = false;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    long jobs = cpus;
+    int timeout = TRACE_TIMEOUT;
+    int repeat = 0;
+    char *record_name = NULL, *compare_name = NULL, *stats_name = NULL;
     int c;
 
-    while ((c = getopt(argc, argv, "hv:f:l:")) != -1) {
+    static const struct option long_opts[] = {
+        {"run-traces", no_argument, NULL, 'R'},
+        {"timeout", required_argument, NULL, 'T'},
+        {"record", required_argument, NULL, 'B'},
+        {"compare", required_argument, NULL, 'C'},
+        {"repeat", required_argument, NULL, 'N'},
+        {"stats", required_argument, NULL, 'S'},
+        {NULL, 0, NULL, 0},
+    };
+    while ((c = getopt_long(argc, argv, "hv:f:l:j:", long_opts, NULL)) != -1) {
         switch (c) {
+        case 'R':
+            traces = true;
+            break;
+        case 'j':
+            jobs = atoi(optarg);
+            break;
+        case 'T':
+            timeout = atoi(optarg);
+            break;
+        case 'B':
+            record_name = optarg;
+            break;
+        case 'C':
+            compare_name = optarg;
+            break;
+        case 'N':
+            repeat = atoi(optarg);
+            break;
+        case 'S':
+            stats_name = optarg;
+            break;
         case 'h':
             usage(argv[0]);
             break;
@@ -1265,6 +1525,7 @@ int main(int argc, char *argv[])
                 fprintf(stderr, "Invalid verbosity level\n");
                 exit(EXIT_FAILURE);
             }
+            level_set = true;
             break;
         }
         case 'l':
@@ -1279,6 +1540,35 @@ int main(int argc, char *argv[])
         }
     }
 
+    if (traces) {
+        /* More jobs than CPUs only measure the contention between them */
+        if (cpus > 0 && jobs > cpus)
+            jobs = cpus;
+        /* Runs measured for a baseline must not compete with each other */
+        if (record_name || compare_name)
+            jobs = 1;
+        int *ids = malloc_or_fail(argc * sizeof(int), "main");
+        runner_opts_t opts = {
+            .prog = argv[0],
+            .jobs = jobs > 0 ? jobs : 1,
+            .verblevel = level_set ? level : 1, /* as the driver */
+            .timeout = timeout,
+            .ids = optind < argc ? ids : NULL,
+            .n_ids = argc - optind,
+            .record = record_name,
+            .compare = compare_name,
+        };
+        if (repeat > 0)
+            opts.repeat = repeat;
+        else
+            opts.repeat = record_name || compare_name ? BASELINE_REPEAT : 1;
+        for (int i = optind; i < argc; i++)
+            ids[i - optind] = atoi(argv[i]);
+        bool ok = run_traces(&opts);
+        free_block(ids, argc * sizeof(int));
+        return !ok;
+    }
+
     /* A better seed can be obtained by combining getpid() and its parent ID
      * with the Unix time.
      */
@@ -1304,6 +1594,7 @@ int main(int argc, char *argv[])
         set_logfile(logfile_name);
 
     add_quit_helper(q_quit);
+    set_bench_reset(bench_reset);
 
     bool ok = true;
     ok = ok && run_console(infile_name);
@@ -1311,5 +1602,8 @@ int main(int argc, char *argv[])
     /* Do finish_cmd() before check whether ok is true or false */
     ok = finish_cmd() && ok;
 
+    if (stats_name && !write_stats(stats_name))
+        perror(stats_name);
+
     return !ok;
 }
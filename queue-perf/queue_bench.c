@@ -0,0 +1,414 @@
+#include <getopt.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Our program needs to use regular malloc/free */
+#define INTERNAL 1
+#include "../harness.h"
+#include "../perfcount.h"
+#include "../queue.h"
+#include "../report.h"
+
+/* report.o echoes to the interpreter's web connection; there is none here */
+int web_connfd;
+
+/* Benchmarks of every operation of queue.h.  Each one builds the queues it
+ * needs, untimed, then times its calls on a queue of the given size.  For
+ * the insert and remove operations that is one call per element; the others
+ * are called once on the whole queue, or repeatedly for q_size.  Their time
+ * per call is also reported per element of the queue, so that all of them
+ * can be compared across sizes.
+ */
+
+#define MIN_SIZE 10
+#define MAX_SIZE 1000000
+#define REVERSE_K 8
+#define MERGE_QUEUES 4
+
+/* Calls of q_size per run, as it is too quick to time on small queues */
+#define SIZE_CALLS 100000
+
+#define MIN_STRLEN 5
+#define MAX_STRLEN 10
+#define BUFSIZE (MAX_STRLEN + 1)
+
+/* Fixed seed, so every run sees the same strings */
+static uint64_t rng_state = 88172645463325252ULL;
+
+static uint64_t rng(void)
+{
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return rng_state;
+}
+
+static void rand_string(char *buf)
+{
+    int len = MIN_STRLEN + rng() % (MAX_STRLEN - MIN_STRLEN + 1);
+    for (int i = 0; i < len; i++)
+        buf[i] = 'a' + rng() % 26;
+    buf[len] = '\0';
+}
+
+static struct list_head *fill(int n)
+{
+    struct list_head *q = q_new();
+    char buf[BUFSIZE];
+    for (int i = 0; i < n; i++) {
+        rand_string(buf);
+        if (!q_insert_tail(q, buf)) {
+            fprintf(stderr, "Out of memory at %d elements\n", i);
+            exit(EXIT_FAILURE);
+        }
+    }
+    return q;
+}
+
+/* Sorted, with every value repeated 4 times */
+static struct list_head *fill_dups(int n)
+{
+    struct list_head *q = q_new();
+    char buf[16];
+    for (int i = 0; i < n; i++) {
+        snprintf(buf, sizeof(buf), "%09d", i / 4);
+        q_insert_tail(q, buf);
+    }
+    return q;
+}
+
+/* Hardware counters, when there are any, summed over the timed runs of a
+ * measurement
+ */
+static perf_counters_t counters;
+static bool have_counters;
+static uint64_t counted[PC_N];
+static uint64_t run_start;
+
+static void bench_start(void)
+{
+    if (have_counters)
+        perf_start(&counters);
+    run_start = time_ns();
+}
+
+/* Return ns since bench_start() */
+static uint64_t bench_stop(void)
+{
+    uint64_t ns = time_ns() - run_start;
+    if (have_counters) {
+        perf_stop(&counters);
+        for (int i = 0; i < PC_N; i++)
+            counted[i] += counters.value[i];
+    }
+    return ns;
+}
+
+/* Each benchmark returns the number of calls it timed, and their time */
+typedef long (*bench_func_t)(int n, uint64_t *ns);
+
+static long bench_insert(int n, uint64_t *ns, bool tail)
+{
+    struct list_head *q = q_new();
+    char buf[BUFSIZE];
+    rand_string(buf);
+    bench_start();
+    for (int i = 0; i < n; i++) {
+        if (tail)
+            q_insert_tail(q, buf);
+        else
+            q_insert_head(q, buf);
+    }
+    *ns = bench_stop();
+    q_free(q);
+    return n;
+}
+
+static long bench_insert_head(int n, uint64_t *ns)
+{
+    return bench_insert(n, ns, false);
+}
+
+static long bench_insert_tail(int n, uint64_t *ns)
+{
+    return bench_insert(n, ns, true);
+}
+
+/* The removed elements are released after the timing */
+static long bench_remove(int n, uint64_t *ns, bool tail)
+{
+    struct list_head *q = fill(n);
+    element_t **removed = malloc(n * sizeof(element_t *));
+    if (!removed) {
+        fprintf(stderr, "Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    char buf[BUFSIZE];
+    bench_start();
+    for (int i = 0; i < n; i++) {
+        if (tail)
+            removed[i] = q_remove_tail(q, buf, sizeof(buf));
+        else
+            removed[i] = q_remove_head(q, buf, sizeof(buf));
+    }
+    *ns = bench_stop();
+    for (int i = 0; i < n; i++) {
+        if (removed[i])
+            q_release_element(removed[i]);
+    }
+    free(removed);
+    q_free(q);
+    return n;
+}
+
+static long bench_remove_head(int n, uint64_t *ns)
+{
+    return bench_remove(n, ns, false);
+}
+
+static long bench_remove_tail(int n, uint64_t *ns)
+{
+    return bench_remove(n, ns, true);
+}
+
+static long bench_size(int n, uint64_t *ns)
+{
+    struct list_head *q = fill(n);
+    long calls = SIZE_CALLS / n > 0 ? SIZE_CALLS / n : 1;
+    long sum = 0;
+    bench_start();
+    for (long i = 0; i < calls; i++)
+        sum += q_size(q);
+    *ns = bench_stop();
+    if (sum != calls * n)
+        fprintf(stderr, "q_size returned %ld for %d elements\n", sum / calls,
+                n);
+    q_free(q);
+    return calls;
+}
+
+/* Time a single call on a queue made by make */
+#define BENCH_ONCE(name, make, call)               \
+    static long bench_##name(int n, uint64_t *ns)  \
+    {                                              \
+        struct list_head *q = make(n);             \
+        bench_start();                             \
+        call;                                      \
+        *ns = bench_stop();                        \
+        q_free(q);                                 \
+        return 1;                                  \
+    }
+
+BENCH_ONCE(delete_mid, fill, q_delete_mid(q))
+BENCH_ONCE(delete_dup, fill_dups, q_delete_dup(q))
+BENCH_ONCE(swap, fill, q_swap(q))
+BENCH_ONCE(reverse, fill, q_reverse(q))
+BENCH_ONCE(reverseK, fill, q_reverseK(q, REVERSE_K))
+BENCH_ONCE(sort, fill, q_sort(q, false))
+BENCH_ONCE(ascend, fill, q_ascend(q))
+BENCH_ONCE(descend, fill, q_descend(q))
+
+/* Merge MERGE_QUEUES sorted queues of n elements in all */
+static long bench_merge(int n, uint64_t *ns)
+{
+    struct list_head chain;
+    INIT_LIST_HEAD(&chain);
+    queue_contex_t ctx[MERGE_QUEUES];
+    for (int i = 0; i < MERGE_QUEUES; i++) {
+        int size = n / MERGE_QUEUES + (i < n % MERGE_QUEUES);
+        ctx[i].q = fill(size);
+        q_sort(ctx[i].q, false);
+        ctx[i].size = size;
+        ctx[i].id = i;
+        list_add_tail(&ctx[i].chain, &chain);
+    }
+    set_noallocate_mode(true);
+    bench_start();
+    q_merge(&chain, false);
+    *ns = bench_stop();
+    set_noallocate_mode(false);
+    for (int i = 0; i < MERGE_QUEUES; i++)
+        q_free(ctx[i].q);
+    return 1;
+}
+
+/* What one call works on: a single element, or the whole queue */
+typedef enum { PER_ELEMENT, PER_QUEUE } unit_t;
+
+static const char *unit_names[] = {"element", "queue"};
+
+static const struct {
+    const char *name;
+    bench_func_t func;
+    unit_t unit;
+} benches[] = {
+    {"insert_head", bench_insert_head, PER_ELEMENT},
+    {"insert_tail", bench_insert_tail, PER_ELEMENT},
+    {"remove_head", bench_remove_head, PER_ELEMENT},
+    {"remove_tail", bench_remove_tail, PER_ELEMENT},
+    {"size", bench_size, PER_QUEUE},
+    {"delete_mid", bench_delete_mid, PER_QUEUE},
+    {"delete_dup", bench_delete_dup, PER_QUEUE},
+    {"swap", bench_swap, PER_QUEUE},
+    {"reverse", bench_reverse, PER_QUEUE},
+    {"reverseK", bench_reverseK, PER_QUEUE},
+    {"sort", bench_sort, PER_QUEUE},
+    {"ascend", bench_ascend, PER_QUEUE},
+    {"descend", bench_descend, PER_QUEUE},
+    {"merge", bench_merge, PER_QUEUE},
+};
+
+#define N_BENCHES (sizeof(benches) / sizeof(benches[0]))
+
+static int warmups = 1;
+static int reps = 5;
+static int max_size = MAX_SIZE;
+
+static FILE *json;
+static bool json_first = true;
+
+/* Run one benchmark at one size and report ns per call over the runs */
+static void measure(int b, int n)
+{
+    for (int i = 0; i < warmups; i++) {
+        uint64_t ns;
+        benches[b].func(n, &ns);
+    }
+    memset(counted, 0, sizeof(counted));
+
+    /* Welford's mean and variance of ns/op */
+    double mean = 0, m2 = 0;
+    long calls = 0;
+    for (int i = 1; i <= reps; i++) {
+        uint64_t ns;
+        calls = benches[b].func(n, &ns);
+        double x = (double) ns / calls;
+        double delta = x - mean;
+        mean += delta / i;
+        m2 += delta * (x - mean);
+    }
+    double stddev = reps > 1 ? sqrt(m2 / (reps - 1)) : 0;
+    if (error_check())
+        fprintf(stderr, "%s: harness reported errors\n", benches[b].name);
+
+    double per_op[PC_N];
+    for (int i = 0; i < PC_N; i++)
+        per_op[i] = (double) counted[i] / ((double) calls * reps);
+    double per_element = benches[b].unit == PER_QUEUE ? mean / n : mean;
+
+    printf("%-12s %9d %14.1f ns/op  %8.2f ns/elem  %14.2f ops/s  +- %5.1f%%",
+           benches[b].name, n, mean, per_element, 1e9 / mean,
+           mean > 0 ? 100 * stddev / mean : 0);
+    if (perf_has(&counters, PC_CYCLES) && perf_has(&counters, PC_INSTRUCTIONS))
+        printf("  IPC %4.2f", per_op[PC_INSTRUCTIONS] / per_op[PC_CYCLES]);
+    if (perf_has(&counters, PC_CACHE_MISSES))
+        printf("  %8.2f misses/op", per_op[PC_CACHE_MISSES]);
+    printf("\n");
+    fflush(stdout);
+    if (json) {
+        fprintf(json,
+                "%s\n    {\"op\": \"%s\", \"size\": %d, \"unit\": \"%s\", "
+                "\"calls\": %ld, \"reps\": %d, \"ns_per_op\": %.3f, "
+                "\"ns_per_element\": %.3f, \"ops_per_sec\": %.3f, "
+                "\"stddev_ns\": %.3f",
+                json_first ? "" : ",", benches[b].name, n,
+                unit_names[benches[b].unit], calls, reps, mean, per_element,
+                1e9 / mean, stddev);
+        for (int i = 0; i < PC_N; i++) {
+            if (perf_has(&counters, i))
+                fprintf(json, ", \"%s_per_op\": %.3f", perf_counter_names[i],
+                        per_op[i]);
+        }
+        fprintf(json, "}");
+        json_first = false;
+    }
+}
+
+static void usage(const char *prog)
+{
+    printf("Usage: %s [-n MAX] [-w WARMUPS] [-r REPS] [-o FILE] [OP...]\n",
+           prog);
+    printf("\t-n MAX      Largest queue, sizes go up by 10 from %d "
+           "(default: %d)\n",
+           MIN_SIZE, MAX_SIZE);
+    printf("\t-w WARMUPS  Untimed runs before each measurement (default: %d)\n",
+           warmups);
+    printf("\t-r REPS     Timed runs of each measurement (default: %d)\n",
+           reps);
+    printf("\t-o FILE     Write the results as JSON to FILE\n");
+    printf("\tOP          Operations to run, all by default:\n\t           ");
+    for (size_t b = 0; b < N_BENCHES; b++)
+        printf(" %s", benches[b].name);
+    printf("\n");
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+    char *json_name = NULL;
+    int c;
+    while ((c = getopt(argc, argv, "n:w:r:o:h")) != -1) {
+        switch (c) {
+        case 'n':
+            max_size = atoi(optarg);
+            break;
+        case 'w':
+            warmups = atoi(optarg);
+            break;
+        case 'r':
+            reps = atoi(optarg);
+            break;
+        case 'o':
+            json_name = optarg;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (reps < 1 || warmups < 0 || max_size < MIN_SIZE)
+        usage(argv[0]);
+
+    bool selected[N_BENCHES];
+    for (size_t b = 0; b < N_BENCHES; b++)
+        selected[b] = optind == argc;
+    for (int i = optind; i < argc; i++) {
+        size_t b = 0;
+        while (b < N_BENCHES && strcmp(argv[i], benches[b].name))
+            b++;
+        if (b == N_BENCHES) {
+            fprintf(stderr, "Unknown operation '%s'\n", argv[i]);
+            usage(argv[0]);
+        }
+        selected[b] = true;
+    }
+
+    if (json_name) {
+        json = fopen(json_name, "w");
+        if (!json) {
+            perror(json_name);
+            return EXIT_FAILURE;
+        }
+        fprintf(json, "{\"warmups\": %d, \"reps\": %d, \"results\": [",
+                warmups, reps);
+    }
+
+    /* Every block is known to be ours, don't search them on each free */
+    set_cautious_mode(false);
+    have_counters = perf_open(&counters);
+    if (!have_counters)
+        printf("No hardware performance counters, timing only\n");
+    for (size_t b = 0; b < N_BENCHES; b++) {
+        for (long n = MIN_SIZE; selected[b] && n <= max_size; n *= 10)
+            measure(b, n);
+    }
+
+    if (json) {
+        fprintf(json, "\n]}\n");
+        fclose(json);
+    }
+    perf_close(&counters);
+    return 0;
+}
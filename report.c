@@ -1,11 +1,15 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <signal.h>
 #include <stdarg.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/resource.h>
-#include <sys/time.h>
+#include <sys/uio.h>
 #include <time.h>
 #include <unistd.h>
 
@@ -14,15 +18,373 @@
 
 #define MAX(a, b) ((a) < (b) ? (b) : (a))
 
-static FILE *errfile = NULL;
-static FILE *verbfile = NULL;
-static FILE *logfile = NULL;
+/* Output goes to stdout, to the log file if any, and to the web client whose
+ * command is running.  A message is formatted once and copied to the buffer
+ * of each sink; the buffer goes out in a single writev() when it fills up,
+ * at the end of each command (report_flush) and at exit.  The web client's
+ * output is already collected per request by web.c.
+ */
+#define SINK_SIZE 65536
+
+typedef struct {
+    int fd; /* -1 when there is no such output */
+    size_t len;
+    char buf[SINK_SIZE];
+} sink_t;
+
+static sink_t out_sink = {.fd = STDOUT_FILENO};
+static sink_t log_sink = {.fd = -1};
+static bool sinks_ready = false;
+
+/* The log file is written by a thread of its own, so that slow storage does
+ * not hold up the commands.  Output reaches it through a ring with a single
+ * producer (the interpreter) and a single consumer (the writer); each side
+ * only moves its own index.  Whoever finds the other side asleep rings its
+ * pipe, which is also safe when a timeout longjmps out of a waiting reader.
+ *
+ * When the ring is full the interpreter waits for room, unless 'logdrop' is
+ * set, in which case the output is dropped and the log notes how much.
+ */
+#define LOG_RING_SIZE (1 << 20)
+
+static struct {
+    char buf[LOG_RING_SIZE];
+    atomic_size_t head;           /* bytes ever queued */
+    atomic_size_t tail;           /* bytes ever written */
+    atomic_bool writer_idle;      /* the writer waits for 'wake' */
+    atomic_bool producer_waiting; /* the interpreter waits for 'room' */
+    atomic_bool stopping;
+    int wake[2];
+    int room[2];
+    pthread_t thread;
+    bool running;
+    size_t dropped; /* bytes not logged since the last note */
+} logq;
+
+int log_drop = 0;
 
 int verblevel = 0;
-static void init_files(FILE *efile, FILE *vfile)
+
+static void writev_all(int fd, struct iovec *iov, int cnt)
+{
+    while (cnt > 0) {
+        ssize_t n = writev(fd, iov, cnt);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return;
+        }
+        /* Skip what was written, a short write leaves the rest for later */
+        while (cnt > 0 && (size_t) n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            cnt--;
+        }
+        if (cnt > 0) {
+            iov->iov_base = (char *) iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+}
+
+static void sink_flush(sink_t *s)
+{
+    if (s->fd < 0 || !s->len)
+        return;
+    /* Keep the order with whatever was printed through stdio */
+    if (s == &out_sink)
+        fflush(stdout);
+    struct iovec iov = {.iov_base = s->buf, .iov_len = s->len};
+    writev_all(s->fd, &iov, 1);
+    s->len = 0;
+}
+
+static void sink_write(sink_t *s, const char *data, size_t len)
+{
+    if (s->fd < 0)
+        return;
+    if (s->len + len <= SINK_SIZE) {
+        memcpy(s->buf + s->len, data, len);
+        s->len += len;
+        return;
+    }
+
+    /* Send what is buffered along with the message */
+    if (s == &out_sink)
+        fflush(stdout);
+    struct iovec iov[2] = {
+        {.iov_base = s->buf, .iov_len = s->len},
+        {.iov_base = (void *) data, .iov_len = len},
+    };
+    writev_all(s->fd, iov, 2);
+    s->len = 0;
+}
+
+static void sink_close(sink_t *s)
+{
+    if (s->fd < 0)
+        return;
+    sink_flush(s);
+    close(s->fd);
+    s->fd = -1;
+}
+
+static void ring(int fd)
+{
+    char c = 0;
+    if (write(fd, &c, 1) < 0) {
+        /* Nothing more can be done */
+    }
+}
+
+static void wait_ring(int fd)
+{
+    char c;
+    while (read(fd, &c, 1) < 0 && errno == EINTR)
+        ;
+}
+
+/* Sleep until the other side clears 'flag' and rings 'fd', unless 'ready'
+ * already holds after announcing it.
+ */
+static void park(atomic_bool *flag, int fd, bool (*ready)(void))
+{
+    atomic_store(flag, true);
+    if (ready() && atomic_exchange(flag, false))
+        return;
+    /* The other side took the flag, so its ring is on the way */
+    wait_ring(fd);
+}
+
+static void unpark(atomic_bool *flag, int fd)
+{
+    if (atomic_exchange(flag, false))
+        ring(fd);
+}
+
+static bool log_pending(void)
+{
+    return atomic_load(&logq.head) != atomic_load(&logq.tail) ||
+           atomic_load(&logq.stopping);
+}
+
+static size_t log_room(void)
+{
+    return LOG_RING_SIZE - (atomic_load(&logq.head) - atomic_load(&logq.tail));
+}
+
+static bool log_has_room(void)
+{
+    return log_room() > 0;
+}
+
+static void *log_writer(void *arg)
+{
+    while (1) {
+        size_t tail = atomic_load(&logq.tail);
+        size_t head = atomic_load(&logq.head);
+        if (head == tail) {
+            if (atomic_load(&logq.stopping))
+                break;
+            park(&logq.writer_idle, logq.wake[0], log_pending);
+            continue;
+        }
+
+        /* Up to the end of the ring, then from its start */
+        size_t start = tail % LOG_RING_SIZE, len = head - tail;
+        struct iovec iov[2] = {{.iov_base = logq.buf + start}};
+        int cnt = 1;
+        if (start + len > LOG_RING_SIZE) {
+            iov[0].iov_len = LOG_RING_SIZE - start;
+            iov[1].iov_base = logq.buf;
+            iov[1].iov_len = len - iov[0].iov_len;
+            cnt = 2;
+        } else {
+            iov[0].iov_len = len;
+        }
+        writev_all(log_sink.fd, iov, cnt);
+
+        atomic_store(&logq.tail, head);
+        unpark(&logq.producer_waiting, logq.room[1]);
+    }
+    return NULL;
+}
+
+static void log_start(void)
+{
+    atomic_store(&logq.head, 0);
+    atomic_store(&logq.tail, 0);
+    atomic_store(&logq.writer_idle, false);
+    atomic_store(&logq.producer_waiting, false);
+    atomic_store(&logq.stopping, false);
+    logq.dropped = 0;
+
+    if (pipe(logq.wake))
+        return;
+    if (pipe(logq.room)) {
+        close(logq.wake[0]);
+        close(logq.wake[1]);
+        return;
+    }
+
+    /* The writer leaves the signals, e.g. SIGALRM, to the interpreter */
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    logq.running = !pthread_create(&logq.thread, NULL, log_writer, NULL);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    /* Otherwise the log is written synchronously through log_sink */
+    if (!logq.running) {
+        for (int i = 0; i < 2; i++) {
+            close(logq.wake[i]);
+            close(logq.room[i]);
+        }
+    }
+}
+
+/* Queue for the writer whatever fits, return the bytes taken */
+static size_t log_push(const char *data, size_t len)
 {
-    errfile = efile;
-    verbfile = vfile;
+    size_t head = atomic_load(&logq.head);
+    size_t room = log_room();
+    if (len > room)
+        len = room;
+
+    size_t start = head % LOG_RING_SIZE;
+    size_t first = len < LOG_RING_SIZE - start ? len : LOG_RING_SIZE - start;
+    memcpy(logq.buf + start, data, first);
+    memcpy(logq.buf, data + first, len - first);
+    atomic_store(&logq.head, head + len);
+    return len;
+}
+
+static void log_flush(void)
+{
+    if (!logq.running) {
+        sink_flush(&log_sink);
+        return;
+    }
+    if (atomic_load(&logq.head) != atomic_load(&logq.tail))
+        unpark(&logq.writer_idle, logq.wake[1]);
+}
+
+/* Queue data, waiting for the writer when the ring is full */
+static void log_put(const char *data, size_t len)
+{
+    while (1) {
+        size_t n = log_push(data, len);
+        data += n;
+        len -= n;
+        if (!len)
+            break;
+        log_flush();
+        park(&logq.producer_waiting, logq.room[0], log_has_room);
+    }
+}
+
+static int log_dropped_note(char *note, size_t size)
+{
+    return snprintf(note, size, "[%zu bytes of log dropped]\n", logq.dropped);
+}
+
+static void log_write(const char *data, size_t len)
+{
+    if (!logq.running) {
+        sink_write(&log_sink, data, len);
+        return;
+    }
+
+    /* Messages are dropped whole, and resumed with a note on how much */
+    char note[64];
+    int n = logq.dropped ? log_dropped_note(note, sizeof(note)) : 0;
+    if (log_drop && n + len > log_room()) {
+        log_flush();
+        logq.dropped += len;
+        return;
+    }
+    if (n) {
+        log_put(note, n);
+        logq.dropped = 0;
+    }
+    log_put(data, len);
+
+    /* Do not wait for the end of the command to start on a large backlog */
+    if (atomic_load(&logq.head) - atomic_load(&logq.tail) >= LOG_RING_SIZE / 2)
+        log_flush();
+}
+
+/* Let the writer finish the backlog and end */
+static void log_stop(void)
+{
+    if (!logq.running)
+        return;
+    if (logq.dropped) {
+        char note[64];
+        log_put(note, log_dropped_note(note, sizeof(note)));
+        logq.dropped = 0;
+    }
+    atomic_store(&logq.stopping, true);
+    unpark(&logq.writer_idle, logq.wake[1]);
+    pthread_join(logq.thread, NULL);
+    for (int i = 0; i < 2; i++) {
+        close(logq.wake[i]);
+        close(logq.room[i]);
+    }
+    logq.running = false;
+}
+
+static void log_close(void)
+{
+    log_stop();
+    sink_close(&log_sink);
+}
+
+void report_flush(void)
+{
+    sink_flush(&out_sink);
+    log_flush();
+}
+
+static void report_exit(void)
+{
+    sink_flush(&out_sink);
+    log_close();
+}
+
+static void init_sinks(void)
+{
+    if (sinks_ready)
+        return;
+    sinks_ready = true;
+    atexit(report_exit);
+}
+
+/* Format into buf of BUF_SIZE bytes, or into an allocated block when the
+ * message is longer.  One byte more than the returned length is free for a
+ * newline.  The caller frees the result when it is not buf.
+ */
+#define BUF_SIZE 4096
+static char *format(char *buf, int *len, const char *fmt, va_list ap)
+{
+    va_list aq;
+    va_copy(aq, ap);
+    int n = vsnprintf(buf, BUF_SIZE - 1, fmt, ap);
+    char *msg = buf;
+    if (n < 0) {
+        n = 0;
+    } else if (n > BUF_SIZE - 2) {
+        msg = malloc(n + 2);
+        if (msg)
+            vsnprintf(msg, n + 1, fmt, aq);
+        else {
+            msg = buf;
+            n = BUF_SIZE - 2;
+        }
+    }
+    va_end(aq);
+    *len = n;
+    return msg;
 }
 
 static char fail_buf[1024] = "FATAL Error.  Exiting\n";
@@ -32,9 +394,10 @@ static volatile int ret = 0;
 /* Default fatal function */
 static void default_fatal_fun()
 {
+    report_flush();
     ret = write(STDOUT_FILENO, fail_buf, strlen(fail_buf) + 1);
-    if (logfile)
-        fputs(fail_buf, logfile);
+    log_write(fail_buf, strlen(fail_buf));
+    log_flush();
 }
 
 /* Optional function to call when fatal error encountered */
@@ -47,8 +410,13 @@ void set_verblevel(int level)
 
 bool set_logfile(const char *file_name)
 {
-    logfile = fopen(file_name, "w");
-    return logfile != NULL;
+    init_sinks();
+    log_close();
+    log_sink.fd = open(file_name, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (log_sink.fd < 0)
+        return false;
+    log_start();
+    return true;
 }
 
 void report_event(message_t msg, char *fmt, ...)
@@ -68,94 +436,71 @@ void report_event(message_t msg, char *fmt, ...)
     if (verblevel < level)
         return;
 
-    if (!errfile)
-        init_files(stdout, stdout);
+    init_sinks();
 
+    char buffer[BUF_SIZE];
+    int len;
     va_start(ap, fmt);
-    fprintf(errfile, "%s: ", msg_name);
-    vfprintf(errfile, fmt, ap);
-    fprintf(errfile, "\n");
-    fflush(errfile);
+    char *text = format(buffer, &len, fmt, ap);
     va_end(ap);
-
-    if (logfile) {
-        va_start(ap, fmt);
-        fprintf(logfile, "Error: ");
-        vfprintf(logfile, fmt, ap);
-        fprintf(logfile, "\n");
-        fflush(logfile);
-        va_end(ap);
-        fclose(logfile);
-    }
+    text[len++] = '\n';
+
+    /* Events are rare and should not wait for the end of the command */
+    sink_write(&out_sink, msg_name, strlen(msg_name));
+    sink_write(&out_sink, ": ", 2);
+    sink_write(&out_sink, text, len);
+    log_write("Error: ", 7);
+    log_write(text, len);
+    report_flush();
+    if (text != buffer)
+        free(text);
 
     if (fatal) {
         if (fatal_fun)
             fatal_fun();
+        log_close();
         exit(1);
     }
 }
 
-#define BUF_SIZE 4096
 extern int web_connfd;
-void report(int level, char *fmt, ...)
+
+static void emit(const char *fmt, va_list ap, bool newline)
 {
-    if (!verbfile)
-        init_files(stdout, stdout);
+    init_sinks();
 
     char buffer[BUF_SIZE];
+    int len;
+    char *text = format(buffer, &len, fmt, ap);
+    if (newline)
+        text[len++] = '\n';
+
+    sink_write(&out_sink, text, len);
+    log_write(text, len);
+    if (web_connfd)
+        web_send(web_connfd, text, len);
+    if (text != buffer)
+        free(text);
+}
+
+void report(int level, char *fmt, ...)
+{
     if (level <= verblevel) {
         va_list ap;
         va_start(ap, fmt);
-        vfprintf(verbfile, fmt, ap);
-        fprintf(verbfile, "\n");
-        fflush(verbfile);
-        va_end(ap);
-
-        if (logfile) {
-            va_start(ap, fmt);
-            vfprintf(logfile, fmt, ap);
-            fprintf(logfile, "\n");
-            fflush(logfile);
-            va_end(ap);
-        }
-        va_start(ap, fmt);
-        vsnprintf(buffer, BUF_SIZE, fmt, ap);
+        emit(fmt, ap, true);
         va_end(ap);
     }
-    if (web_connfd) {
-        int len = strlen(buffer);
-        buffer[len] = '\n';
-        buffer[len + 1] = '\0';
-        web_send(web_connfd, buffer);
-    }
 }
 
 void report_noreturn(int level, char *fmt, ...)
 {
-    if (!verbfile)
-        init_files(stdout, stdout);
-
-    char buffer[BUF_SIZE];
     if (level <= verblevel) {
         va_list ap;
         va_start(ap, fmt);
-        vfprintf(verbfile, fmt, ap);
-        fflush(verbfile);
-        va_end(ap);
-
-        if (logfile) {
-            va_start(ap, fmt);
-            vfprintf(logfile, fmt, ap);
-            fflush(logfile);
-            va_end(ap);
-        }
-        va_start(ap, fmt);
-        vsnprintf(buffer, BUF_SIZE, fmt, ap);
+        emit(fmt, ap, false);
         va_end(ap);
     }
-
-    if (web_connfd)
-        web_send(web_connfd, buffer);
 }
 
 /* Functions denoting failures */
@@ -167,18 +512,14 @@ static void fail_fun(const char *format, const char *msg)
     /* Tack on return */
     fail_buf[strlen(fail_buf)] = '\n';
     /* Use write to avoid any buffering issues */
+    report_flush();
     ret = write(STDOUT_FILENO, fail_buf, strlen(fail_buf) + 1);
-
-    if (logfile) {
-        /* Don't know file descriptor for logfile */
-        fputs(fail_buf, logfile);
-    }
+    log_write(fail_buf, strlen(fail_buf));
 
     if (fatal_fun)
         fatal_fun();
 
-    if (logfile)
-        fclose(logfile);
+    log_close();
 
     exit(1);
 }
@@ -304,11 +645,20 @@ void init_time(double *timep)
     (void) delta_time(timep);
 }
 
+uint64_t time_ns(void)
+{
+    struct timespec ts;
+#ifdef CLOCK_MONOTONIC_RAW
+    clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+#else
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+#endif
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
 double delta_time(double *timep)
 {
-    struct timeval tv;
-    gettimeofday(&tv, NULL);
-    double current_time = tv.tv_sec + 1.0E-6 * tv.tv_usec;
+    double current_time = time_ns() * 1e-9;
     double delta = current_time - *timep;
     *timep = current_time;
     return delta;
@@ -3,6 +3,7 @@
 
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stdint.h>
 
 /* Ways to report interesting behavior and errors */
 
@@ -14,6 +15,9 @@ typedef enum { MSG_WARN, MSG_ERROR, MSG_FATAL, N_MSG } message_t;
 
 bool set_logfile(const char *file_name);
 
+/* Drop log output instead of waiting when the log writer falls behind */
+extern int log_drop;
+
 extern int verblevel;
 void set_verblevel(int level);
 
@@ -26,6 +30,11 @@ void report(int verblevel, char *fmt, ...);
 /* Like report, but without return character */
 void report_noreturn(int verblevel, char *fmt, ...);
 
+/* Write out buffered output.  Done after every command and at exit; code
+ * that prints to stdout directly calls it first.
+ */
+void report_flush(void);
+
 /* Attempt to call malloc.  Fail when returns NULL */
 void *malloc_or_fail(size_t bytes, const char *fun_name);
 
@@ -44,6 +53,9 @@ void free_array(void *b, size_t cnt, size_t bytes);
 /* Free string saved by strsave_or_fail */
 void free_string(char *s);
 
+/* Nanoseconds from a clock that is not slewed by NTP */
+uint64_t time_ns(void);
+
 /* Time counted as fp number in seconds */
 void init_time(double *timep);
 
@@ -0,0 +1,465 @@
+/* Parallel trace runner, for qtest --run-traces */
+
+#include <errno.h>
+#include <math.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <spawn.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "dudect/ttest.h"
+#include "report.h"
+#include "runner.h"
+
+extern char **environ;
+
+/* Same traces and points as scripts/driver.py */
+#define TRACE_DIR "./traces"
+#define N_TRACES 17
+
+static const char *trace_names[N_TRACES + 1] = {
+    NULL,
+    "trace-01-ops",
+    "trace-02-ops",
+    "trace-03-ops",
+    "trace-04-ops",
+    "trace-05-ops",
+    "trace-06-ops",
+    "trace-07-string",
+    "trace-08-robust",
+    "trace-09-robust",
+    "trace-10-robust",
+    "trace-11-malloc",
+    "trace-12-malloc",
+    "trace-13-malloc",
+    "trace-14-perf",
+    "trace-15-perf",
+    "trace-16-perf",
+    "trace-17-complexity",
+};
+
+static const int max_scores[N_TRACES + 1] = {0, 5, 6, 6, 6, 6, 6, 6, 6,
+                                             6, 6, 6, 6, 6, 6, 6, 6, 5};
+
+/* The perf traces time out, and trace-17 measures timing, when other traces
+ * compete with them for the CPU.  These run alone, after all the others.
+ */
+static bool runs_alone(int id)
+{
+    return strstr(trace_names[id], "-perf") ||
+           strstr(trace_names[id], "-complexity");
+}
+
+#define RED "\033[91m"
+#define GREEN "\033[92m"
+#define WHITE "\033[0m"
+
+/* Like printInColor of the driver, but colored only when stdout is a tty */
+static void print_in_color(const char *color, const char *fmt, ...)
+{
+    bool tty = isatty(STDOUT_FILENO);
+    va_list ap;
+    va_start(ap, fmt);
+    if (tty)
+        printf("%s", color);
+    vprintf(fmt, ap);
+    printf("%s\n", tty ? WHITE : "");
+    va_end(ap);
+}
+
+/* Measurements of each run, kept in baseline files */
+typedef enum { M_WALL, M_CPU, M_RSS, M_ALLOCS, M_PEAK, N_METRICS } metric_t;
+
+static const char *metric_names[N_METRICS] = {
+    "wall_s", "cpu_s", "maxrss_kib", "allocs", "peak_bytes",
+};
+
+/* A regression is a mean at least MIN_CHANGE worse than the baseline whose
+ * Welch t statistic is beyond T_THRESHOLD.  Measurements that do not vary
+ * between runs, such as the allocation counts, need no test.
+ */
+#define MIN_CHANGE 0.10
+#define T_THRESHOLD 4.0
+
+typedef struct {
+    int id;
+    pid_t pid;      /* 0 when not running */
+    FILE *out;      /* stdout and stderr of the run */
+    char stats[32]; /* where the run writes its harness counters, or "" */
+    uint64_t start;
+    double m[N_METRICS];
+    bool ok, done, timed_out;
+} trace_run_t;
+
+static void start_trace(const runner_opts_t *opts, trace_run_t *r)
+{
+    char level[16], fname[64];
+    snprintf(level, sizeof(level), "%d", opts->verblevel);
+    snprintf(fname, sizeof(fname), "%s/%s.cmd", TRACE_DIR, trace_names[r->id]);
+    char *argv[] = {
+        (char *) opts->prog, "-v", level, "-f", fname, NULL, NULL, NULL,
+    };
+
+    r->out = tmpfile();
+    if (!r->out) {
+        perror("tmpfile");
+        exit(EXIT_FAILURE);
+    }
+    if (opts->record || opts->compare) {
+        strncpy(r->stats, "/tmp/qtest-stats.XXXXXX", sizeof(r->stats));
+        int fd = mkstemp(r->stats);
+        if (fd < 0) {
+            perror("mkstemp");
+            exit(EXIT_FAILURE);
+        }
+        close(fd);
+        argv[5] = "--stats";
+        argv[6] = r->stats;
+    }
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, fileno(r->out), STDOUT_FILENO);
+    posix_spawn_file_actions_adddup2(&actions, fileno(r->out), STDERR_FILENO);
+
+    r->start = time_ns();
+    int err = posix_spawnp(&r->pid, opts->prog, &actions, NULL, argv, environ);
+    posix_spawn_file_actions_destroy(&actions);
+    if (err) {
+        fprintf(r->out, "Call of '%s' failed: %s\n", opts->prog, strerror(err));
+        r->pid = 0;
+        r->done = true;
+    }
+}
+
+/* Pick up the counters the run wrote at exit */
+static void read_stats(trace_run_t *r)
+{
+    FILE *f = fopen(r->stats, "r");
+    char key[32];
+    double val;
+    while (f && fscanf(f, "%31s %lf", key, &val) == 2) {
+        for (int i = 0; i < N_METRICS; i++) {
+            if (!strcmp(key, metric_names[i]))
+                r->m[i] = val;
+        }
+    }
+    if (f)
+        fclose(f);
+    unlink(r->stats);
+}
+
+static void finish_trace(trace_run_t *r, int status, const struct rusage *ru)
+{
+    r->m[M_WALL] = (time_ns() - r->start) * 1e-9;
+    r->m[M_CPU] = ru->ru_utime.tv_sec + ru->ru_stime.tv_sec +
+                  (ru->ru_utime.tv_usec + ru->ru_stime.tv_usec) * 1e-6;
+#if defined(__APPLE__)
+    r->m[M_RSS] = ru->ru_maxrss >> 10; /* bytes */
+#else
+    r->m[M_RSS] = ru->ru_maxrss;
+#endif
+    if (r->stats[0])
+        read_stats(r);
+    r->ok = !r->timed_out && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    if (WIFSIGNALED(status) && !r->timed_out)
+        fprintf(r->out, "Terminated by signal %d\n", WTERMSIG(status));
+    r->pid = 0;
+    r->done = true;
+}
+
+/* Whether every run of the trace at index i is finished */
+static bool trace_done(const runner_opts_t *opts,
+                       const trace_run_t *runs,
+                       int n,
+                       int i)
+{
+    for (int j = 0; j < opts->repeat; j++) {
+        if (!runs[j * n + i].done)
+            return false;
+    }
+    return true;
+}
+
+/* Print a finished trace as the driver does.  Of its repeated runs, the
+ * first that failed is shown, or else the first one.
+ */
+static int show_trace(const runner_opts_t *opts,
+                      const trace_run_t *runs,
+                      int n,
+                      int i)
+{
+    const trace_run_t *r = &runs[i];
+    for (int j = 0; j < opts->repeat; j++) {
+        if (!runs[j * n + i].ok) {
+            r = &runs[j * n + i];
+            break;
+        }
+    }
+    const char *name = trace_names[r->id];
+    if (opts->verblevel > 0)
+        printf("+++ TESTING trace %s:\n", name);
+    rewind(r->out);
+    char buf[4096];
+    size_t len;
+    while ((len = fread(buf, 1, sizeof(buf), r->out)) > 0)
+        fwrite(buf, 1, len, stdout);
+    for (int j = 0; j < opts->repeat; j++)
+        fclose(runs[j * n + i].out);
+    if (r->timed_out)
+        printf("ERROR: %s timed out after %d seconds\n", name, opts->timeout);
+
+    int score = r->ok ? max_scores[r->id] : 0;
+    print_in_color(r->ok ? GREEN : RED, "---\t%s\t%d/%d", name, score,
+                   max_scores[r->id]);
+    fflush(stdout);
+    return score;
+}
+
+static int find_trace(const char *name)
+{
+    for (int id = 1; id <= N_TRACES; id++) {
+        if (!strcmp(name, trace_names[id]))
+            return id;
+    }
+    return 0;
+}
+
+/* Write one line per successful run: the trace name and its measurements */
+static bool record_baseline(const char *fname,
+                            const trace_run_t *runs,
+                            int total)
+{
+    FILE *f = fopen(fname, "w");
+    if (!f) {
+        perror(fname);
+        return false;
+    }
+    fprintf(f, "# trace");
+    for (int j = 0; j < N_METRICS; j++)
+        fprintf(f, " %s", metric_names[j]);
+    fprintf(f, "\n");
+    int cnt = 0;
+    for (int i = 0; i < total; i++) {
+        if (!runs[i].ok)
+            continue;
+        fprintf(f, "%s", trace_names[runs[i].id]);
+        for (int j = 0; j < N_METRICS; j++)
+            fprintf(f, " %.9g", runs[i].m[j]);
+        fprintf(f, "\n");
+        cnt++;
+    }
+    fclose(f);
+    printf("+++\tBaseline of %d runs written to %s\n", cnt, fname);
+    return true;
+}
+
+/* How much worse class 1 (this run) is than class 0 (the baseline), in
+ * standard errors.  NaN when that cannot be told.
+ */
+static double regression_t(t_context_t *ctx)
+{
+    if (ctx->n[0] < 1 || ctx->n[1] < 1)
+        return NAN;
+    if (ctx->m2[0] == 0 && ctx->m2[1] == 0)
+        return ctx->mean[1] > ctx->mean[0] ? INFINITY : 0;
+    if (ctx->n[0] < 2 || ctx->n[1] < 2)
+        return NAN;
+    return -t_compute(ctx);
+}
+
+static bool compare_baseline(const char *fname,
+                             const trace_run_t *runs,
+                             int n,
+                             int total)
+{
+    FILE *f = fopen(fname, "r");
+    if (!f) {
+        perror(fname);
+        return false;
+    }
+    t_context_t ctx[N_TRACES + 1][N_METRICS];
+    for (int id = 0; id <= N_TRACES; id++) {
+        for (int j = 0; j < N_METRICS; j++)
+            t_init(&ctx[id][j]);
+    }
+
+    char line[MAX_CHAR];
+    while (fgets(line, sizeof(line), f)) {
+        char name[64];
+        double m[N_METRICS];
+        if (line[0] == '#' ||
+            sscanf(line, "%63s %lf %lf %lf %lf %lf", name, &m[M_WALL],
+                   &m[M_CPU], &m[M_RSS], &m[M_ALLOCS], &m[M_PEAK]) != 6)
+            continue;
+        int id = find_trace(name);
+        for (int j = 0; id && j < N_METRICS; j++)
+            t_push(&ctx[id][j], m[j], 0);
+    }
+    fclose(f);
+    for (int i = 0; i < total; i++) {
+        for (int j = 0; runs[i].ok && j < N_METRICS; j++)
+            t_push(&ctx[runs[i].id][j], runs[i].m[j], 1);
+    }
+
+    bool ok = true;
+    for (int i = 0; i < n; i++) {
+        int id = runs[i].id;
+        if (ctx[id][0].n[1] == 0)
+            continue; /* failed every run */
+        if (ctx[id][0].n[0] == 0) {
+            printf("+++\t%s\tnot in %s\n", trace_names[id], fname);
+            continue;
+        }
+        for (int j = 0; j < N_METRICS; j++) {
+            t_context_t *c = &ctx[id][j];
+            double base = c->mean[0], cur = c->mean[1];
+            double change = base > 0 ? cur / base - 1 : 0;
+            double t = regression_t(c);
+            int prec = j < M_RSS ? 3 : 0; /* seconds, or counts */
+            const char *fmt = "+++\t%s\t%-10s\t%12.*f -> %12.*f\t%+6.1f%%"
+                              "\tt = %.1f%s";
+            if (change >= MIN_CHANGE && t > T_THRESHOLD) {
+                print_in_color(RED, fmt, trace_names[id], metric_names[j],
+                               prec, base, prec, cur, change * 100, t,
+                               "\tREGRESSION");
+                ok = false;
+            } else {
+                printf(fmt, trace_names[id], metric_names[j], prec, base,
+                       prec, cur, change * 100, t, "\n");
+            }
+        }
+    }
+    fflush(stdout);
+    return ok;
+}
+
+bool run_traces(const runner_opts_t *opts)
+{
+    int all[N_TRACES], n = 0;
+    const int *ids = all;
+    if (opts->ids) {
+        for (int i = 0; i < opts->n_ids; i++) {
+            if (opts->ids[i] < 1 || opts->ids[i] > N_TRACES) {
+                print_in_color(RED, "ERROR: Invalid trace ID %d",
+                               opts->ids[i]);
+                return false;
+            }
+        }
+        ids = opts->ids;
+        n = opts->n_ids;
+    } else {
+        /* Baselines are about the perf traces */
+        bool perf_only = opts->record || opts->compare;
+        for (int id = 1; id <= N_TRACES; id++) {
+            if (!perf_only || strstr(trace_names[id], "-perf"))
+                all[n++] = id;
+        }
+    }
+
+    /* Run j of the trace at index i is at j * n + i */
+    int total = n * opts->repeat;
+    trace_run_t *runs =
+        calloc_or_fail(total, sizeof(trace_run_t), "run_traces");
+    for (int i = 0; i < total; i++)
+        runs[i].id = ids[i % n];
+
+    /* Runs in the order they start: the traces which may share the CPU,
+     * then those which run alone.  Both from the end, where the longer
+     * traces are.
+     */
+    int *order = malloc_or_fail(total * sizeof(int), "run_traces");
+    int n_order = 0;
+    for (int alone = 0; alone < 2; alone++) {
+        for (int i = total - 1; i >= 0; i--) {
+            if (runs_alone(runs[i].id) == alone)
+                order[n_order++] = i;
+        }
+    }
+
+    printf("---\tTrace\t\tPoints\n");
+    fflush(stdout);
+
+    uint64_t wall = time_ns();
+    int next = 0, running = 0, shown = 0;
+    int score = 0, maxscore = 0;
+    while (shown < n) {
+        while (next < total) {
+            trace_run_t *r = &runs[order[next]];
+            bool alone = runs_alone(r->id);
+            if (alone ? running > 0 : running >= opts->jobs)
+                break;
+            start_trace(opts, r);
+            next++;
+            if (r->pid)
+                running++;
+        }
+
+        int status;
+        struct rusage ru;
+        pid_t pid = wait4(-1, &status, WNOHANG, &ru);
+        if (pid > 0) {
+            for (int i = 0; i < total; i++) {
+                if (runs[i].pid == pid) {
+                    finish_trace(&runs[i], status, &ru);
+                    running--;
+                    break;
+                }
+            }
+        } else if (pid < 0 && errno != EINTR && errno != ECHILD) {
+            perror("wait4");
+            exit(EXIT_FAILURE);
+        }
+
+        /* Show finished traces in order */
+        while (shown < n && trace_done(opts, runs, n, shown)) {
+            score += show_trace(opts, runs, n, shown);
+            maxscore += max_scores[runs[shown].id];
+            shown++;
+        }
+        if (pid > 0)
+            continue;
+
+        uint64_t now = time_ns();
+        for (int i = 0; i < total; i++) {
+            if (runs[i].pid && !runs[i].timed_out && opts->timeout > 0 &&
+                now - runs[i].start > (uint64_t) opts->timeout * 1000000000) {
+                kill(runs[i].pid, SIGKILL);
+                runs[i].timed_out = true;
+            }
+        }
+        struct timespec pause = {.tv_sec = 0, .tv_nsec = 2000000};
+        nanosleep(&pause, NULL);
+    }
+    wall = time_ns() - wall;
+
+    print_in_color(score < maxscore ? RED : GREEN, "---\tTOTAL\t\t%d/%d",
+                   score, maxscore);
+    for (int i = 0; i < n; i++) {
+        double elapsed = 0, maxrss = 0;
+        for (int j = 0; j < opts->repeat; j++) {
+            elapsed += runs[j * n + i].m[M_WALL];
+            maxrss = fmax(maxrss, runs[j * n + i].m[M_RSS]);
+        }
+        printf("+++\t%s\t%8.3f s\t%6.1f MiB\n", trace_names[runs[i].id],
+               elapsed / opts->repeat, maxrss / 1024.0);
+    }
+    printf("+++\tWALL TIME\t%8.3f s\t%d jobs\n", wall * 1e-9, opts->jobs);
+    fflush(stdout);
+
+    bool ok = score == maxscore;
+    if (opts->compare && !compare_baseline(opts->compare, runs, n, total))
+        ok = false;
+    if (opts->record && !record_baseline(opts->record, runs, total))
+        ok = false;
+
+    free_block(order, total * sizeof(int));
+    free_array(runs, total, sizeof(trace_run_t));
+    return ok;
+}
@@ -0,0 +1,35 @@
+#ifndef LAB0_RUNNER_H
+#define LAB0_RUNNER_H
+
+#include <stdbool.h>
+
+/* Run the traces of traces/ the way scripts/driver.py does, each in its own
+ * qtest process, but up to 'jobs' at a time.  The timing-sensitive traces
+ * (perf and complexity) run one at a time, after the others.  A trace still
+ * running after 'timeout' seconds (0: no limit) is killed and scores nothing.
+ * The output of each trace is shown in trace order, followed by the driver's
+ * scoring table and the time and peak memory of each trace.
+ *
+ * With 'record' or 'compare', every trace (the perf traces when 'ids' is
+ * NULL) runs 'repeat' times and its wall time, CPU time, peak RSS and harness
+ * allocation counters are written to the baseline file 'record', or compared
+ * with those in 'compare' to flag statistically significant regressions.
+ */
+typedef struct {
+    const char *prog; /* qtest binary to run */
+    int jobs;
+    int verblevel;
+    int timeout;
+    const int *ids; /* traces to run, all when NULL */
+    int n_ids;
+    int repeat;          /* runs of each trace */
+    const char *record;  /* baseline file to write, or NULL */
+    const char *compare; /* baseline file to compare with, or NULL */
+} runner_opts_t;
+
+/* Return true if every trace scored full points and, when comparing, none
+ * regressed
+ */
+bool run_traces(const runner_opts_t *opts);
+
+#endif /* LAB0_RUNNER_H */
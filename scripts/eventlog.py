@@ -0,0 +1,74 @@
+#!/usr/bin/env python3
+
+"""Convert an event log written by the 'record' command of qtest to CSV or
+JSON.  The format is described in eventlog.h."""
+
+import argparse
+import csv
+import json
+import struct
+import sys
+
+MAGIC = b"QTEVLOG1"
+HEADER = struct.Struct("=8sIIQ")
+RECORD = struct.Struct("=IHBBQQqqQQ")
+FIELDS = ["start_ns", "duration_ns", "ok", "depth", "blocks", "bytes",
+          "allocs", "frees", "command"]
+
+
+def records(data):
+    magic, header_size, segment_size, start_time = HEADER.unpack_from(data)
+    if magic != MAGIC:
+        raise ValueError("not an event log")
+
+    pos = header_size
+    while pos + RECORD.size <= len(data):
+        size, argc, ok, depth, start, duration, blocks, nbytes, allocs, \
+            frees = RECORD.unpack_from(data, pos)
+        if size == 0:
+            # Rest of the segment is unused
+            pos = (pos // segment_size + 1) * segment_size
+            continue
+        if size < RECORD.size or pos + size > len(data):
+            break
+        args = data[pos + RECORD.size:pos + size].split(b"\0")[:argc]
+        yield {
+            "start_ns": start,
+            "duration_ns": duration,
+            "ok": bool(ok),
+            "depth": depth,
+            "blocks": blocks,
+            "bytes": nbytes,
+            "allocs": allocs,
+            "frees": frees,
+            "command": " ".join(a.decode(errors="replace") for a in args),
+        }
+        pos += size
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument("log", help="event log written by 'record'")
+    parser.add_argument("-f", "--format", choices=["csv", "json"],
+                        default="csv", help="output format (default: csv)")
+    args = parser.parse_args()
+
+    with open(args.log, "rb") as f:
+        data = f.read()
+    try:
+        events = list(records(data))
+    except (ValueError, struct.error) as e:
+        print(f"{args.log}: {e}", file=sys.stderr)
+        sys.exit(1)
+
+    if args.format == "json":
+        json.dump(events, sys.stdout, indent=1)
+        print()
+    else:
+        writer = csv.DictWriter(sys.stdout, fieldnames=FIELDS)
+        writer.writeheader()
+        writer.writerows(events)
+
+
+if __name__ == "__main__":
+    main()
@@ -1,5 +1,6 @@
 #include <assert.h>
 #include <getopt.h>
+#include <inttypes.h>
 #include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -7,7 +8,12 @@
 #include <sys/types.h>
 #include <time.h>
 #include <unistd.h>
+
+/* Our program needs to use regular malloc/free */
+#define INTERNAL 1
+#include "../harness.h"
 #include "../list_sort.h"
+#include "../perfcount.h"
 #include "../queue.h"
 #include "../random.h"
 
@@ -23,11 +29,22 @@ static int n_comp = 0;
 static double exec_time = 0;
 static double k = 0;
 
+/* Hardware counters of the sort, when there are any */
+static perf_counters_t counters;
+static bool have_counters = false;
+static uint64_t total_counted[PC_N];
+
 #define MIN_RANDSTR_LEN 5
 #define MAX_RANDSTR_LEN 10
 static const char charset[] = "abcdefghijklmnopqrstuvwxyz";
 static char *file_path = NULL;
 
+/* Workload of the random queues, and its run length, period or number of
+ * distinct values
+ */
+static const char *dist_name = "random";
+static int dist_k = 16;
+
 static inline int q_less(void *priv,
                          const struct list_head *a,
                          const struct list_head *b)
@@ -219,7 +236,11 @@ void my_sort(struct list_head *head, bool descend)
     struct list_head *h = head->next, *t = head->next;
     struct list_head *sublist = NULL;
     while (h != head) {
-        while (t->next != head && q_cmp(NULL, t, t->next) <= 0) {
+        /* The comparisons of run detection count too */
+        while (t->next != head) {
+            n_comp++;
+            if (q_cmp(NULL, t, t->next) > 0)
+                break;
             t = t->next;
         }
         h->prev = sublist;
@@ -325,6 +346,160 @@ static void q_comp_fixed_init(struct list_head *head, int size)
     fclose(fp);
 }
 
+/* Workload generators.  Numeric keys are zero padded, so that their string
+ * order is their numeric order.
+ */
+#define PREFIX_LEN 64
+#define MAX_VARLEN 256
+#define ZIPF_VALUES 1000
+
+static void insert_key(struct list_head *head, unsigned key)
+{
+    char buf[16];
+    snprintf(buf, sizeof(buf), "%010u", key);
+    q_insert_tail(head, buf);
+}
+
+static void gen_sorted(struct list_head *head, int n)
+{
+    for (int i = 0; i < n; i++)
+        insert_key(head, i);
+}
+
+static void gen_reversed(struct list_head *head, int n)
+{
+    for (int i = 0; i < n; i++)
+        insert_key(head, n - 1 - i);
+}
+
+static int cmp_unsigned(const void *a, const void *b)
+{
+    unsigned x = *(const unsigned *) a, y = *(const unsigned *) b;
+    return (x > y) - (x < y);
+}
+
+/* Random keys, sorted in runs of k */
+static void gen_ksorted(struct list_head *head, int n)
+{
+    unsigned *run = malloc(dist_k * sizeof(unsigned));
+    if (!run) {
+        printf("Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < n; i += dist_k) {
+        int len = n - i < dist_k ? n - i : dist_k;
+        for (int j = 0; j < len; j++)
+            run[j] = rand();
+        qsort(run, len, sizeof(unsigned), cmp_unsigned);
+        for (int j = 0; j < len; j++)
+            insert_key(head, run[j]);
+    }
+    free(run);
+}
+
+/* 0 .. k-1, repeated */
+static void gen_sawtooth(struct list_head *head, int n)
+{
+    for (int i = 0; i < n; i++)
+        insert_key(head, i % dist_k);
+}
+
+/* Rising to the middle, then falling */
+static void gen_organpipe(struct list_head *head, int n)
+{
+    for (int i = 0; i < n; i++)
+        insert_key(head, i < n / 2 ? i : n - 1 - i);
+}
+
+/* Only k distinct values, equally likely */
+static void gen_fewunique(struct list_head *head, int n)
+{
+    for (int i = 0; i < n; i++)
+        insert_key(head, rand() % dist_k);
+}
+
+/* ZIPF_VALUES distinct values, the r-th most common drawn with probability
+ * proportional to 1/r
+ */
+static void gen_zipf(struct list_head *head, int n)
+{
+    double cdf[ZIPF_VALUES], sum = 0;
+    for (int r = 0; r < ZIPF_VALUES; r++) {
+        sum += 1.0 / (r + 1);
+        cdf[r] = sum;
+    }
+    for (int i = 0; i < n; i++) {
+        double u = (double) rand() / RAND_MAX * sum;
+        int lo = 0, hi = ZIPF_VALUES - 1;
+        while (lo < hi) {
+            int mid = (lo + hi) / 2;
+            if (cdf[mid] < u)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        /* Scatter the ranks, so the common values are not the small keys */
+        insert_key(head, (unsigned) lo * 2654435761u);
+    }
+}
+
+/* Random strings behind a PREFIX_LEN long common prefix */
+static void gen_prefix(struct list_head *head, int n)
+{
+    char buf[PREFIX_LEN + MAX_RANDSTR_LEN];
+    memset(buf, 'a', PREFIX_LEN);
+    for (int i = 0; i < n; i++) {
+        fill_rand_string(buf + PREFIX_LEN, MAX_RANDSTR_LEN);
+        q_insert_tail(head, buf);
+    }
+}
+
+/* Random strings of 1 to MAX_VARLEN characters */
+static void gen_varlen(struct list_head *head, int n)
+{
+    char buf[MAX_VARLEN + 1];
+    for (int i = 0; i < n; i++) {
+        int len = 1 + rand() % MAX_VARLEN;
+        for (int j = 0; j < len; j++)
+            buf[j] = charset[rand() % (sizeof(charset) - 1)];
+        buf[len] = '\0';
+        q_insert_tail(head, buf);
+    }
+}
+
+static void gen_random(struct list_head *head, int n)
+{
+    q_comp_rand_init(head, n, 1);
+}
+
+static const struct {
+    const char *name;
+    void (*init)(struct list_head *head, int n);
+    const char *summary;
+} dists[] = {
+    {"random", gen_random, "random strings of 5 to 9 characters"},
+    {"sorted", gen_sorted, "already in order"},
+    {"reversed", gen_reversed, "in reverse order"},
+    {"ksorted", gen_ksorted, "random, sorted in runs of K"},
+    {"sawtooth", gen_sawtooth, "0 to K-1, repeated"},
+    {"organpipe", gen_organpipe, "rising, then falling"},
+    {"fewunique", gen_fewunique, "K distinct values"},
+    {"zipf", gen_zipf, "Zipf-distributed duplicates"},
+    {"prefix", gen_prefix, "random strings behind a long common prefix"},
+    {"varlen", gen_varlen, "random strings of 1 to 256 characters"},
+};
+
+#define N_DISTS (sizeof(dists) / sizeof(dists[0]))
+
+static int find_dist(const char *name)
+{
+    for (size_t i = 0; i < N_DISTS; i++) {
+        if (!strcmp(name, dists[i].name))
+            return i;
+    }
+    return -1;
+}
+
 static void getPerf(int n, int random, bool descend)
 {
     struct list_head *head = q_new();
@@ -332,9 +507,11 @@ static void getPerf(int n, int random, bool descend)
     if (random == 0) {
         q_comp_fixed_init(head, n);
     } else {
-        q_comp_rand_init(head, n, random);
+        dists[find_dist(dist_name)].init(head, n);
     }
 
+    if (have_counters)
+        perf_start(&counters);
     clock_t start_time = clock();
     if (sort == 1) {
         list_sort(NULL, head, descend);
@@ -342,6 +519,8 @@ static void getPerf(int n, int random, bool descend)
         my_sort(head, descend);
     }
     clock_t end_time = clock();
+    if (have_counters)
+        perf_stop(&counters);
 
     exec_time = (double) (end_time - start_time) / CLOCKS_PER_SEC;
     k = log2(n_data) - (double) (n_comp - 1) / n;
@@ -349,6 +528,12 @@ static void getPerf(int n, int random, bool descend)
     printf("Execution time: %.lf\n", exec_time);
     printf("Total Number of Comparison: %d\n", n_comp);
     printf("Value of K= %.5lf\n", k);
+    for (int i = 0; i < PC_N; i++) {
+        if (!perf_has(&counters, i))
+            continue;
+        printf("%s: %" PRIu64 "\n", perf_counter_names[i], counters.value[i]);
+        total_counted[i] += counters.value[i];
+    }
 
     q_free(head);
 }
@@ -369,9 +554,14 @@ static inline void show_config()
     printf("Fixed/Random Queue Content?: ");
     if (random_data == 1) {
         printf("Random\n");
+        printf("Distribution: %s (%s), K = %d\n", dist_name,
+               dists[find_dist(dist_name)].summary, dist_k);
     } else {
         printf("Fixed\n");
     }
+
+    printf("Hardware counters: %s\n",
+           have_counters ? "yes" : "not available, timing only");
 }
 
 int main(int argc, char *argv[])
@@ -379,7 +569,7 @@ int main(int argc, char *argv[])
     srand(os_random(getpid() ^ getppid()));
 
     int c;
-    while ((c = getopt(argc, argv, "s:n:r:t:f:")) != -1) {
+    while ((c = getopt(argc, argv, "s:n:r:t:f:d:k:")) != -1) {
         switch (c) {
         case 's':
             sort = atoi(optarg);
@@ -397,12 +587,29 @@ int main(int argc, char *argv[])
         case 'f':
             file_path = optarg;
             break;
+        case 'd':
+            dist_name = optarg;
+            break;
+        case 'k':
+            dist_k = atoi(optarg);
+            break;
         default:
             printf("Unknown option '%c'\n", c);
             break;
         }
     }
 
+    if (find_dist(dist_name) < 0 || dist_k < 1) {
+        printf("Unknown distribution '%s' or K below 1.  Distributions:\n",
+               dist_name);
+        for (size_t i = 0; i < N_DISTS; i++)
+            printf("  %-10s %s\n", dists[i].name, dists[i].summary);
+        return EXIT_FAILURE;
+    }
+
+    /* Every block is known to be ours, don't search them on each free */
+    set_cautious_mode(false);
+    have_counters = perf_open(&counters);
     show_config();
     printf("---------------\n");
 
@@ -425,6 +632,16 @@ int main(int argc, char *argv[])
            (double) total_comp / n_tests);
     printf("Average Execution Time : %.5lf\n", total_exec_time / n_tests);
     printf("Average k : %.5lf\n", total_k / n_tests);
+    for (int i = 0; i < PC_N; i++) {
+        if (perf_has(&counters, i))
+            printf("Average %s : %.1lf\n", perf_counter_names[i],
+                   (double) total_counted[i] / n_tests);
+    }
+    if (perf_has(&counters, PC_CYCLES) && perf_has(&counters, PC_INSTRUCTIONS))
+        printf("Instructions per cycle : %.3lf\n",
+               (double) total_counted[PC_INSTRUCTIONS] /
+                   total_counted[PC_CYCLES]);
+    perf_close(&counters);
 
     return 0;
 }
\ No newline at end of file
@@ -1,7 +1,13 @@
 # Test if time complexity of q_insert_tail, q_insert_head, q_remove_tail, and q_remove_head is constant
+# and if q_size, q_delete_mid, q_reverse, q_swap, and q_sort stay within their expected complexity
 option simulation 1
 it
 ih
 rh
 rt
+size
+dm
+reverse
+swap
+sort
 option simulation 0
@@ -0,0 +1,114 @@
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "../web.h"
+
+/* web.o reports through the interpreter's connection; nothing is sent here */
+int web_connfd;
+
+static const char curl_req[] =
+    "GET /ih/dolphin HTTP/1.1\r\n"
+    "Host: localhost:9999\r\n"
+    "User-Agent: curl/8.5.0\r\n"
+    "Accept: */*\r\n"
+    "\r\n";
+
+static const char browser_req[] =
+    "GET /it/a%20b/c%2Fd?x=1 HTTP/1.1\r\n"
+    "Host: localhost:9999\r\n"
+    "Connection: keep-alive\r\n"
+    "Cache-Control: max-age=0\r\n"
+    "sec-ch-ua: \"Chromium\";v=\"124\", \"Not-A.Brand\";v=\"99\"\r\n"
+    "sec-ch-ua-mobile: ?0\r\n"
+    "sec-ch-ua-platform: \"Linux\"\r\n"
+    "Upgrade-Insecure-Requests: 1\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, "
+    "like Gecko) Chrome/124.0.0.0 Safari/537.36\r\n"
+    "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,"
+    "image/avif,image/webp,*/*;q=0.8\r\n"
+    "Sec-Fetch-Site: none\r\n"
+    "Sec-Fetch-Mode: navigate\r\n"
+    "Accept-Encoding: gzip, deflate, br\r\n"
+    "Accept-Language: en-US,en;q=0.9\r\n"
+    "Range: bytes=100-199\r\n"
+    "\r\n";
+
+static const char pipelined_req[] = "GET /size HTTP/1.1\r\n\r\n";
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* Parse n_requests copies of req, laid out back to back as a client sending
+ * them pipelined would.  The buffer is refilled for every batch since the
+ * parser decodes the URI in place.
+ */
+static void bench(const char *name, const char *req, long n_requests)
+{
+    size_t len = strlen(req);
+    size_t per_batch = 65536 / len;
+    char *pattern = malloc(per_batch * len);
+    char *buf = malloc(per_batch * len);
+    if (!pattern || !buf) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    for (size_t i = 0; i < per_batch; i++)
+        memcpy(pattern + i * len, req, len);
+
+    long parsed = 0;
+    size_t sum = 0;
+    double elapsed = 0;
+    while (parsed < n_requests) {
+        memcpy(buf, pattern, per_batch * len);
+        double start = now();
+        size_t pos = 0;
+        http_request_t r;
+        ssize_t n;
+        while ((n = http_parse(buf + pos, per_batch * len - pos, &r)) > 0) {
+            pos += n;
+            sum += r.cmd_len;
+            parsed++;
+        }
+        elapsed += now() - start;
+        if (n < 0) {
+            fprintf(stderr, "%s: malformed request\n", name);
+            exit(1);
+        }
+    }
+
+    printf("%-10s %5zu bytes  %12.0f req/s  %8.1f ns/req  %7.1f MB/s\n", name,
+           len, parsed / elapsed, elapsed * 1e9 / parsed,
+           parsed * len / elapsed / 1e6);
+    if (!sum)
+        printf("no command parsed\n");
+    free(pattern);
+    free(buf);
+}
+
+int main(int argc, char *argv[])
+{
+    long n_requests = 1000000;
+
+    int c;
+    while ((c = getopt(argc, argv, "n:")) != -1) {
+        switch (c) {
+        case 'n':
+            n_requests = atol(optarg);
+            break;
+        default:
+            printf("Usage: %s [-n requests]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    bench("curl", curl_req, n_requests);
+    bench("browser", browser_req, n_requests);
+    bench("pipelined", pipelined_req, n_requests);
+    return 0;
+}
@@ -2,19 +2,52 @@
  * MIT License.
  */
 
+#ifdef __linux__
+#define _GNU_SOURCE /* accept4 */
+#endif
+
 #include <arpa/inet.h> /* inet_ntoa */
 #include <errno.h>
+#include <fcntl.h>
 #include <netinet/tcp.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h> /* strncasecmp */
 #include <sys/socket.h>
 #include <unistd.h>
 
+#ifdef __linux__
+#include <sys/epoll.h>
+#define WATCH_IN EPOLLIN
+#define WATCH_OUT EPOLLOUT
+#define WATCH_ERR (EPOLLHUP | EPOLLERR)
+#else
+#define WATCH_IN POLLIN
+#define WATCH_OUT POLLOUT
+#define WATCH_ERR (POLLHUP | POLLERR)
+#endif
+
+#include "web.h"
+
 #define LISTENQ 1024 /* second argument to listen() */
 #define MAXLINE 1024 /* max length of a line */
 #define BUFSIZE 1024
 
+#define MAX_CONNS 64          /* client connections served at once */
+#define MAX_EVENTS (MAX_CONNS + 2)
+#define CONN_BUFSIZE 8192     /* unparsed input of one connection */
+#define MAX_BODY (1 << 20)    /* the buffer grows up to this for a body */
+#define OUT_LIMIT (1 << 20)   /* stop parsing requests beyond this backlog */
+#define MAX_INFLIGHT 16       /* queued or running commands per connection */
+#define QUEUE_SIZE (MAX_CONNS * MAX_INFLIGHT)
+#define MAX_WORKERS 16        /* I/O threads */
+
 #ifndef DEFAULT_PORT
 #define DEFAULT_PORT 9999 /* use this port if none given as arg to main() */
 #endif
@@ -25,57 +58,6 @@
 
 static int server_fd;
 
-typedef struct {
-    int fd;            /* descriptor for this buf */
-    int count;         /* unread byte in this buf */
-    char *bufptr;      /* next unread byte in this buf */
-    char buf[BUFSIZE]; /* internal buffer */
-} rio_t;
-
-typedef struct {
-    char filename[512];
-    off_t offset; /* for support Range */
-    size_t end;
-} http_request_t;
-
-static void rio_readinitb(rio_t *rp, int fd)
-{
-    rp->fd = fd;
-    rp->count = 0;
-    rp->bufptr = rp->buf;
-}
-
-/* This is a wrapper for the Unix read() function that transfers min(n, count)
- * bytes from an internal buffer to a user buffer, where n is the number of
- * bytes requested by the user and count is the number of unread bytes in the
- * internal buffer. On entry, rio_read() refills the internal buffer via a call
- * to read() if the internal buffer is empty.
- */
-/* $begin rio_read */
-static ssize_t rio_read(rio_t *rp, char *usrbuf, size_t n)
-{
-    int cnt;
-    while (rp->count <= 0) { /* refill if buf is empty */
-        rp->count = read(rp->fd, rp->buf, sizeof(rp->buf));
-        if (rp->count < 0) {
-            if (errno != EINTR) /* interrupted by sig handler return */
-                return -1;
-        } else if (rp->count == 0) { /* EOF */
-            return 0;
-        } else
-            rp->bufptr = rp->buf; /* reset buffer ptr */
-    }
-
-    /* Copy min(n, rp->count) bytes from internal buf to user buf */
-    cnt = n;
-    if (rp->count < n)
-        cnt = rp->count;
-    memcpy(usrbuf, rp->bufptr, cnt);
-    rp->bufptr += cnt;
-    rp->count -= cnt;
-    return cnt;
-}
-
 static ssize_t writen(int fd, void *usrbuf, size_t n)
 {
     size_t nleft = n;
@@ -95,35 +77,266 @@ static ssize_t writen(int fd, void *usrbuf, size_t n)
     return n;
 }
 
-/* robustly read a text line (buffered) */
-static ssize_t rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen)
+typedef struct web_worker web_worker_t;
+
+/* A client connection, served by the I/O thread that accepted it.  Requests
+ * may arrive back to back (pipelining); the unparsed bytes wait in 'in',
+ * responses that the socket did not take yet wait in 'out'.
+ *
+ * The interpreter thread appends responses, so 'inflight', 'closing' and
+ * the 'out' buffer are guarded by the lock of the worker.
+ */
+typedef struct {
+    int fd;               /* -1 when the slot is free */
+    web_worker_t *worker; /* I/O thread serving it */
+    uint32_t events;      /* what is watched for, WATCH_IN and WATCH_OUT */
+    bool eof;             /* the client will not send anything more */
+    bool last;            /* the last request before closing was queued */
+    bool bad;             /* a request could not be parsed */
+    bool closing;         /* close once 'out' is sent */
+    int inflight;         /* commands queued or running */
+    size_t in_start;      /* first byte of 'in' not parsed yet */
+    size_t in_len;        /* bytes in 'in' */
+    size_t in_cap;        /* allocated size of 'in' */
+    char *in;
+    char *out;            /* responses not yet written */
+    size_t out_len;       /* bytes in 'out' */
+    size_t out_sent;      /* bytes of 'out' already written */
+    size_t out_cap;       /* allocated size of 'out' */
+} web_conn_t;
+
+/* An I/O thread.  It accepts connections, parses their requests into the
+ * command queue and writes back the responses of the interpreter.
+ */
+struct web_worker {
+    pthread_t thread;
+    pthread_mutex_t lock; /* guards the connections it serves */
+    int wake[2];          /* pipe written to when responses are ready */
+    bool woken;           /* a byte is pending in 'wake' */
+    int owned[MAX_CONNS]; /* slots of the connections it serves */
+    int n_owned;
+#ifdef __linux__
+    int epoll_fd;
+#endif
+};
+
+/* A request waiting for the interpreter */
+typedef struct {
+    web_conn_t *conn;
+    bool keep_alive;
+    char *batch; /* commands of a POST, one per line, or NULL */
+    size_t cmd_len;
+    char cmd[MAXLINE];
+} web_cmd_t;
+
+/* Bounded queue from the I/O threads to the interpreter.  No connection has
+ * more than MAX_INFLIGHT commands in it, so it never overflows and commands
+ * of a connection stay in arrival order.
+ */
+static struct {
+    pthread_mutex_t lock;
+    size_t head;     /* next command to run */
+    size_t tail;     /* where the next command is queued */
+    int doorbell[2]; /* pipe written to when the queue becomes non-empty */
+    web_cmd_t items[QUEUE_SIZE];
+} cmdq = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+static web_conn_t conns[MAX_CONNS];
+static pthread_mutex_t conns_lock = PTHREAD_MUTEX_INITIALIZER; /* slot fds */
+static web_worker_t workers[MAX_WORKERS];
+static int n_workers;
+static atomic_bool stopping;
+
+/* Connection whose command is running and the output it produced so far.
+ * These belong to the interpreter thread.
+ */
+static web_conn_t *active;
+static bool active_close;
+static char *body;
+static size_t body_len, body_cap;
+
+/* Batch being run for 'active' and its next command, NULL when none */
+static char *batch;
+static char *batch_next;
+
+/* Output of the running command goes here, see report() */
+extern int web_connfd;
+
+/* Watch ids of the non-client descriptors, clients use their slot index */
+enum { WATCH_WAKE = MAX_CONNS, WATCH_SERVER };
+
+static bool append(char **buf,
+                   size_t *len,
+                   size_t *cap,
+                   const char *data,
+                   size_t n)
+{
+    if (*len + n > *cap) {
+        size_t new_cap = *cap ? *cap : BUFSIZE;
+        while (new_cap < *len + n)
+            new_cap *= 2;
+        char *p = realloc(*buf, new_cap);
+        if (!p)
+            return false;
+        *buf = p;
+        *cap = new_cap;
+    }
+    memcpy(*buf + *len, data, n);
+    *len += n;
+    return true;
+}
+
+void web_send(int out_fd, const char *buf, size_t len)
 {
-    char c, *bufp = usrbuf;
+    if (active && out_fd == active->fd) {
+        append(&body, &body_len, &body_cap, buf, len);
+        return;
+    }
+    writen(out_fd, (void *) buf, len);
+}
 
-    int n;
-    for (n = 1; n < maxlen; n++) {
-        int rc;
-        if ((rc = rio_read(rp, &c, 1)) == 1) {
-            *bufp++ = c;
-            if (c == '\n')
-                break;
-        } else if (rc == 0) {
-            if (n == 1)
-                return 0; /* EOF, no data read */
-            break;        /* EOF, some data was read */
-        } else
-            return -1; /* error */
-    }
-    *bufp = 0;
+static bool set_nonblocking(int fd)
+{
+    int flags = fcntl(fd, F_GETFL, 0);
+    return flags >= 0 && fcntl(fd, F_SETFL, flags | O_NONBLOCK) == 0;
+}
+
+/* Empty a wake-up pipe */
+static void drain(int fd)
+{
+    char junk[64];
+    while (read(fd, junk, sizeof(junk)) > 0)
+        ;
+}
+
+static void ring(int fd)
+{
+    char c = 0;
+    if (write(fd, &c, 1) < 0) {
+        /* A full pipe already wakes the reader */
+    }
+}
+
+/* Readiness notification of an I/O thread: epoll where available, poll()
+ * otherwise.  Either way only the connections with a non-zero 'events' are
+ * watched.
+ */
+#ifdef __linux__
+static bool watch_init(web_worker_t *w)
+{
+    w->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (w->epoll_fd < 0)
+        return false;
+
+    struct epoll_event ev = {.events = EPOLLIN, .data.u32 = WATCH_WAKE};
+    if (epoll_ctl(w->epoll_fd, EPOLL_CTL_ADD, w->wake[0], &ev) < 0)
+        return false;
+
+    ev.data.u32 = WATCH_SERVER;
+#ifdef EPOLLEXCLUSIVE
+    /* Only one of the threads is woken up for a new connection */
+    ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+    if (epoll_ctl(w->epoll_fd, EPOLL_CTL_ADD, server_fd, &ev) == 0)
+        return true;
+    ev.events = EPOLLIN;
+#endif
+    return epoll_ctl(w->epoll_fd, EPOLL_CTL_ADD, server_fd, &ev) == 0;
+}
+
+static bool watch(web_worker_t *w, int fd, uint32_t id, uint32_t events,
+                  bool add)
+{
+    struct epoll_event ev = {.events = events, .data.u32 = id};
+    int op = add ? EPOLL_CTL_ADD : EPOLL_CTL_MOD;
+    return !epoll_ctl(w->epoll_fd, op, fd, &ev);
+}
+
+static int watch_wait(web_worker_t *w, uint32_t *ids, uint32_t *revents)
+{
+    struct epoll_event events[MAX_EVENTS];
+    int n = epoll_wait(w->epoll_fd, events, MAX_EVENTS, -1);
+    for (int i = 0; i < n; i++) {
+        ids[i] = events[i].data.u32;
+        revents[i] = events[i].events;
+    }
     return n;
 }
+#else
+static bool watch_init(web_worker_t *w)
+{
+    return true;
+}
+
+static bool watch(web_worker_t *w, int fd, uint32_t id, uint32_t events,
+                  bool add)
+{
+    return true;
+}
 
-void web_send(int out_fd, char *buf)
+static int watch_wait(web_worker_t *w, uint32_t *ids, uint32_t *revents)
 {
-    writen(out_fd, buf, strlen(buf));
+    struct pollfd fds[MAX_EVENTS];
+    uint32_t fd_ids[MAX_EVENTS];
+    int nfds = 0;
+
+    fds[nfds] = (struct pollfd){.fd = server_fd, .events = POLLIN};
+    fd_ids[nfds++] = WATCH_SERVER;
+    fds[nfds] = (struct pollfd){.fd = w->wake[0], .events = POLLIN};
+    fd_ids[nfds++] = WATCH_WAKE;
+    for (int i = 0; i < w->n_owned; i++) {
+        web_conn_t *c = &conns[w->owned[i]];
+        if (!c->events)
+            continue;
+        fds[nfds] = (struct pollfd){.fd = c->fd, .events = c->events};
+        fd_ids[nfds++] = w->owned[i];
+    }
+
+    int ready = poll(fds, nfds, -1);
+    int n = 0;
+    for (int i = 0; i < nfds && ready > 0; i++) {
+        if (!fds[i].revents)
+            continue;
+        ids[n] = fd_ids[i];
+        revents[n++] = fds[i].revents;
+    }
+    return ready < 0 ? ready : n;
 }
+#endif
+
+static void web_atexit(void);
+static void *web_worker_run(void *arg);
 
-int web_open(int port)
+/* Start the I/O threads.  They must not take the signals qtest handles with
+ * siglongjmp(), so they run with every signal blocked.
+ */
+static bool web_start(int threads)
+{
+    for (int i = 0; i < MAX_CONNS; i++)
+        conns[i].fd = -1;
+
+    if (pipe(cmdq.doorbell) || !set_nonblocking(cmdq.doorbell[0]) ||
+        !set_nonblocking(cmdq.doorbell[1]))
+        return false;
+
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    for (n_workers = 0; n_workers < threads; n_workers++) {
+        web_worker_t *w = &workers[n_workers];
+        if (pipe(w->wake) || !set_nonblocking(w->wake[0]) ||
+            !set_nonblocking(w->wake[1]) || !watch_init(w))
+            break;
+        pthread_mutex_init(&w->lock, NULL);
+        if (pthread_create(&w->thread, NULL, web_worker_run, w))
+            break;
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    atexit(web_atexit);
+    return n_workers > 0;
+}
+
+int web_open(int port, int threads)
 {
     int listenfd, optval = 1;
     struct sockaddr_in serveraddr;
@@ -156,115 +369,743 @@ int web_open(int port)
     if (listen(listenfd, LISTENQ) < 0)
         return -1;
 
+    if (!set_nonblocking(listenfd))
+        return -1;
+
     server_fd = listenfd;
+    if (threads < 1)
+        threads = 1;
+    if (threads > MAX_WORKERS)
+        threads = MAX_WORKERS;
+    if (!web_start(threads))
+        return -1;
 
     return listenfd;
 }
 
-static void url_decode(char *src, char *dest, int max)
+static bool starts_with(const char *p,
+                        size_t len,
+                        const char *lit,
+                        size_t lit_len)
+{
+    if (len < lit_len)
+        return false;
+    /* lit is lower case; or-ing 0x20 folds letters and keeps '-' as is */
+    for (size_t i = 0; i < lit_len; i++) {
+        if ((p[i] | 0x20) != lit[i])
+            return false;
+    }
+    return true;
+}
+
+static inline bool name_is(const char *p,
+                           size_t len,
+                           const char *lit,
+                           size_t lit_len)
+{
+    return len == lit_len && starts_with(p, len, lit, lit_len);
+}
+
+static inline int hex_digit(char c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    c |= 0x20;
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    return -1;
+}
+
+/* Parse the decimal number at *p, moving *p past it.  Return false if there
+ * is none or it does not fit.
+ */
+static bool parse_number(const char **p, const char *end, size_t *value)
+{
+    const char *q = *p;
+    size_t v = 0;
+    for (; q < end && *q >= '0' && *q <= '9'; q++) {
+        if (v > (SIZE_MAX - 9) / 10)
+            return false;
+        v = v * 10 + (*q - '0');
+    }
+    if (q == *p)
+        return false;
+    *p = q;
+    *value = v;
+    return true;
+}
+
+/* Turn the URI from uri to uri_end into a command, in place: drop the leading
+ * '/' and the query, decode %XX escapes and separate the arguments with
+ * spaces instead of '/'.  The result is never longer than the URI.
+ */
+static size_t uri_to_cmd(char *uri, char *uri_end)
 {
-    char *p = src;
-    char code[3] = {0};
-    while (*p && --max) {
-        if (*p == '%') {
-            memcpy(code, ++p, 2);
-            *dest++ = (char) strtoul(code, NULL, 16);
-            p += 2;
-        } else {
-            *dest++ = *p++;
+    char *src = uri, *stop = uri_end, *dst = uri;
+    if (*src == '/')
+        src++;
+    char *query = memchr(src, '?', stop - src);
+    if (query)
+        stop = query;
+    if (src == stop)
+        *dst++ = '.';
+
+    while (src < stop && dst - uri < MAXLINE - 1) {
+        char c = *src++;
+        if (c == '%' && stop - src >= 2 && hex_digit(src[0]) >= 0 &&
+            hex_digit(src[1]) >= 0) {
+            c = (char) (hex_digit(src[0]) << 4 | hex_digit(src[1]));
+            src += 2;
         }
+        *dst++ = c == '/' ? ' ' : c;
     }
-    *dest = '\0';
+    *dst = '\0';
+    return dst - uri;
 }
 
-static void parse_request(int fd, http_request_t *req)
+ssize_t http_parse(char *buf, size_t len, http_request_t *req)
 {
-    rio_t rio;
-    char buf[MAXLINE], method[MAXLINE], uri[MAXLINE];
+    char *end = buf + len;
+    req->body = NULL;
+
+    /* Request line: method SP uri [SP version] */
+    char *eol = memchr(buf, '\n', len);
+    if (!eol)
+        return 0;
+    char *line_end = eol > buf && eol[-1] == '\r' ? eol - 1 : eol;
+    char *sp = memchr(buf, ' ', line_end - buf);
+    if (!sp || sp == buf)
+        return -1;
+    req->method = buf;
+    req->method_len = sp - buf;
+
+    char *uri = sp + 1;
+    char *uri_end = memchr(uri, ' ', line_end - uri);
+    if (!uri_end)
+        uri_end = line_end;
+    if (uri_end == uri)
+        return -1;
+
+    /* HTTP/1.1 keeps the connection by default, older versions close it */
+    const char *version = uri_end < line_end ? uri_end + 1 : line_end;
+    req->keep_alive = line_end - version == 8 && !memcmp(version, "HTTP/1.1", 8);
+    req->content_length = 0;
     req->offset = 0;
-    req->end = 0; /* default */
-
-    rio_readinitb(&rio, fd);
-    rio_readlineb(&rio, buf, MAXLINE);
-    sscanf(buf, "%1023s %1023s", method, uri); /* version is not cared */
-    /* read all */
-    while (buf[0] != '\n' && buf[1] != '\n') { /* \n || \r\n */
-        rio_readlineb(&rio, buf, MAXLINE);
-        if (buf[0] == 'R' && buf[1] == 'a' && buf[2] == 'n') {
-            sscanf(buf, "Range: bytes=%lu-%lu", (unsigned long *) &req->offset,
-                   (unsigned long *) &req->end);
-            /* Range: [start, end] */
-            if (req->end != 0)
-                req->end++;
+    req->end = 0;
+
+    /* Header lines up to the blank one; only a few are of interest */
+    char *p = eol + 1;
+    while (1) {
+        if (p >= end || !(eol = memchr(p, '\n', end - p)))
+            return 0;
+        const char *e = eol > p && eol[-1] == '\r' ? eol - 1 : eol;
+        if (e == p)
+            break;
+
+        const char *colon = memchr(p, ':', e - p);
+        if (colon) {
+            size_t name_len = colon - p;
+            const char *v = colon + 1;
+            while (v < e && (*v == ' ' || *v == '\t'))
+                v++;
+            size_t v_len = e - v;
+
+            if (name_is(p, name_len, "connection", 10)) {
+                if (starts_with(v, v_len, "close", 5))
+                    req->keep_alive = false;
+                else if (starts_with(v, v_len, "keep-alive", 10))
+                    req->keep_alive = true;
+            } else if (name_is(p, name_len, "content-length", 14)) {
+                if (!parse_number(&v, e, &req->content_length))
+                    return -1;
+            } else if (name_is(p, name_len, "range", 5) &&
+                       starts_with(v, v_len, "bytes=", 6)) {
+                /* Range: bytes=start-[end], end inclusive */
+                size_t offset = 0, last = 0;
+                v += 6;
+                if (parse_number(&v, e, &offset) && v < e && *v++ == '-') {
+                    req->offset = offset;
+                    if (parse_number(&v, e, &last))
+                        req->end = last + 1;
+                }
+            }
         }
+        p = eol + 1;
     }
-    char *filename = uri;
-    if (uri[0] == '/') {
-        filename = uri + 1;
-        int length = strlen(filename);
-        if (length == 0) {
-            filename = ".";
-        } else {
-            for (int i = 0; i < length; ++i) {
-                if (filename[i] == '?') {
-                    filename[i] = '\0';
-                    break;
-                }
+
+    size_t head = eol + 1 - buf;
+    req->body = buf + head;
+    if (req->content_length > len - head)
+        return 0;
+
+    /* Complete: now the URI may be decoded in place */
+    req->cmd = uri;
+    req->cmd_len = uri_to_cmd(uri, uri_end);
+    return head + req->content_length;
+}
+
+/* The parts below run in the I/O threads, with the lock of the worker held
+ * while the connection is touched, unless noted otherwise.
+ */
+
+static void conn_close(web_conn_t *c)
+{
+    web_worker_t *w = c->worker;
+    for (int i = 0; i < w->n_owned; i++) {
+        if (w->owned[i] == c - conns) {
+            w->owned[i] = w->owned[--w->n_owned];
+            break;
+        }
+    }
+
+    /* Closing the only descriptor also stops watching it */
+    close(c->fd);
+    c->in_start = c->in_len = 0;
+    /* Give back what a large body needed */
+    if (c->in_cap > CONN_BUFSIZE) {
+        free(c->in);
+        c->in = NULL;
+        c->in_cap = 0;
+    }
+    c->out_len = c->out_sent = 0;
+    pthread_mutex_lock(&conns_lock);
+    c->fd = -1;
+    pthread_mutex_unlock(&conns_lock);
+}
+
+/* Watch for input only while there is room for it and the client reads its
+ * responses, and for output only while some is pending.
+ */
+static void conn_update(web_conn_t *c)
+{
+    size_t backlog = c->out_len - c->out_sent;
+    if (c->closing && !backlog && !c->inflight) {
+        conn_close(c);
+        return;
+    }
+
+    uint32_t events = 0;
+    if (!c->eof && !c->last && !c->bad && !c->closing &&
+        c->in_len - c->in_start < c->in_cap && backlog < OUT_LIMIT)
+        events |= WATCH_IN;
+    if (backlog)
+        events |= WATCH_OUT;
+
+    if (events != c->events) {
+        watch(c->worker, c->fd, c - conns, events, false);
+        c->events = events;
+    }
+}
+
+static void conn_flush(web_conn_t *c)
+{
+    while (c->out_sent < c->out_len) {
+        ssize_t n =
+            write(c->fd, c->out + c->out_sent, c->out_len - c->out_sent);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                /* Client went away, drop what it did not read */
+                c->out_len = c->out_sent = 0;
+                c->closing = true;
             }
+            break;
         }
+        c->out_sent += n;
     }
-    url_decode(filename, req->filename, MAXLINE);
+    if (c->out_sent == c->out_len)
+        c->out_len = c->out_sent = 0;
+    conn_update(c);
 }
 
-char *web_recv(int fd, struct sockaddr_in *clientaddr)
+/* 'in' belongs to the I/O thread, no lock needed */
+static void conn_read(web_conn_t *c)
 {
-    http_request_t req;
-    parse_request(fd, &req);
+    /* Requests are parsed where they were read; move the unparsed tail to the
+     * front only when the end of the buffer is reached.
+     */
+    if (c->in_start && c->in_len == c->in_cap) {
+        c->in_len -= c->in_start;
+        memmove(c->in, c->in + c->in_start, c->in_len);
+        c->in_start = 0;
+    }
+
+    while (c->in_len < c->in_cap) {
+        size_t room = c->in_cap - c->in_len;
+        ssize_t n = read(c->fd, c->in + c->in_len, room);
+        if (n > 0) {
+            c->in_len += n;
+            /* A short read drained the socket, the next wait reports more */
+            if ((size_t) n < room)
+                break;
+            continue;
+        }
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+            c->eof = true;
+        break;
+    }
+}
+
+static void web_accept(web_worker_t *w)
+{
+    while (1) {
+#ifdef __linux__
+        int fd = accept4(server_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
+        int fd = accept(server_fd, NULL, NULL);
+        if (fd >= 0 && !set_nonblocking(fd)) {
+            close(fd);
+            continue;
+        }
+#endif
+        if (fd < 0)
+            return;
+
+        web_conn_t *c = NULL;
+        pthread_mutex_lock(&conns_lock);
+        for (int i = 0; i < MAX_CONNS; i++) {
+            if (conns[i].fd < 0) {
+                c = &conns[i];
+                c->fd = fd;
+                c->worker = w;
+                break;
+            }
+        }
+        pthread_mutex_unlock(&conns_lock);
+        if (c && !c->in) {
+            c->in = malloc(CONN_BUFSIZE);
+            if (c->in) {
+                c->in_cap = CONN_BUFSIZE;
+            } else {
+                pthread_mutex_lock(&conns_lock);
+                c->fd = -1;
+                pthread_mutex_unlock(&conns_lock);
+                c = NULL;
+            }
+        }
+        if (!c) {
+            /* Connection table is full, or no memory for one more */
+            static char busy[] =
+                "HTTP/1.1 503 Service Unavailable\r\n"
+                "Content-Length: 0\r\nConnection: close\r\n\r\n";
+            writen(fd, busy, sizeof(busy) - 1);
+            close(fd);
+            continue;
+        }
 
-    char *p = req.filename;
-    /* Change '/' to ' ' */
-    while (*p) {
-        ++p;
-        if (*p == '/')
-            *p = ' ';
+        /* Responses go out in a single write, so do not hold them back */
+        int optval = 0;
+        setsockopt(fd, IPPROTO_TCP, TCP_CORK, &optval, sizeof(optval));
+        optval = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &optval, sizeof(optval));
+
+        pthread_mutex_lock(&w->lock);
+        c->events = WATCH_IN;
+        c->eof = c->last = c->bad = c->closing = false;
+        c->inflight = 0;
+        c->in_start = c->in_len = 0;
+        c->out_len = c->out_sent = 0;
+        w->owned[w->n_owned++] = c - conns;
+        if (!watch(w, fd, c - conns, WATCH_IN, true))
+            conn_close(c);
+        pthread_mutex_unlock(&w->lock);
     }
-    char *ret = malloc(strlen(req.filename) + 1);
-    strncpy(ret, req.filename, strlen(req.filename) + 1);
+}
 
-    return ret;
+/* Also called from the interpreter thread */
+static void conn_respond(web_conn_t *c,
+                         const char *status,
+                         const char *data,
+                         size_t len,
+                         bool close_after)
+{
+    char header[256];
+    int n = snprintf(header, sizeof(header),
+                     "HTTP/1.1 %s\r\nContent-Type: text/plain\r\n"
+                     "Content-Length: %zu\r\n%s\r\n",
+                     status, len, close_after ? "Connection: close\r\n" : "");
+    if (!append(&c->out, &c->out_len, &c->out_cap, header, n) ||
+        !append(&c->out, &c->out_len, &c->out_cap, data, len))
+        close_after = true;
+    if (close_after)
+        c->closing = true;
 }
 
-int web_eventmux(char *buf)
+/* Pieces of a response whose length is not known up front: the head, then a
+ * chunk per piece of data, then an empty chunk to end it.  Called from the
+ * interpreter thread.
+ */
+static void conn_stream(web_conn_t *c,
+                        bool start,
+                        const char *data,
+                        size_t len,
+                        bool end)
 {
-    fd_set listenset;
+    char header[256];
+    bool ok = true;
+
+    if (start) {
+        int n = snprintf(header, sizeof(header),
+                         "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\n"
+                         "Transfer-Encoding: chunked\r\n\r\n");
+        ok = append(&c->out, &c->out_len, &c->out_cap, header, n);
+    }
+    if (ok && len) {
+        int n = snprintf(header, sizeof(header), "%zx\r\n", len);
+        ok = append(&c->out, &c->out_len, &c->out_cap, header, n) &&
+             append(&c->out, &c->out_len, &c->out_cap, data, len) &&
+             append(&c->out, &c->out_len, &c->out_cap, "\r\n", 2);
+    }
+    if (ok && end)
+        ok = append(&c->out, &c->out_len, &c->out_cap, "0\r\n\r\n", 5);
+    /* A response cut short cannot be told from a complete one otherwise */
+    if (!ok)
+        c->closing = true;
+}
 
-    FD_ZERO(&listenset);
-    FD_SET(STDIN_FILENO, &listenset);
-    int max_fd = STDIN_FILENO;
-    if (server_fd > 0) {
-        FD_SET(server_fd, &listenset);
-        max_fd = max_fd > server_fd ? max_fd : server_fd;
+/* Make room in 'in' for a request of 'need' bytes from 'in_start' on */
+static bool conn_reserve(web_conn_t *c, size_t need)
+{
+    if (need > c->in_cap) {
+        char *p = realloc(c->in, need);
+        if (!p)
+            return false;
+        c->in = p;
+        c->in_cap = need;
     }
-    int result = select(max_fd + 1, &listenset, NULL, NULL, NULL);
-    if (result < 0)
+    if (c->in_start + need > c->in_cap) {
+        c->in_len -= c->in_start;
+        memmove(c->in, c->in + c->in_start, c->in_len);
+        c->in_start = 0;
+    }
+    return true;
+}
+
+/* Parse the first unparsed request of c.  Return 1 if one was taken, 0 if
+ * more input is needed and -1 if the request cannot be served.
+ */
+static int conn_parse(web_conn_t *c, http_request_t *req)
+{
+    size_t avail = c->in_len - c->in_start;
+    ssize_t n = http_parse(c->in + c->in_start, avail, req);
+    if (n < 0)
         return -1;
+    if (!n) {
+        /* A head that does not fit the buffer is not served */
+        if (!req->body)
+            return avail >= CONN_BUFSIZE ? -1 : 0;
+        /* The body may need a larger one */
+        size_t head = req->body - (c->in + c->in_start);
+        if (req->content_length > MAX_BODY ||
+            !conn_reserve(c, head + req->content_length))
+            return -1;
+        return 0;
+    }
 
-    if (server_fd > 0 && FD_ISSET(server_fd, &listenset)) {
-        FD_CLR(server_fd, &listenset);
-        struct sockaddr_in clientaddr;
-        socklen_t clientlen = sizeof(clientaddr);
-        int web_connfd =
-            accept(server_fd, (struct sockaddr *) &clientaddr, &clientlen);
+    c->in_start += n;
+    if (c->in_start == c->in_len)
+        c->in_start = c->in_len = 0;
+    return 1;
+}
+
+static void cmdq_push(web_conn_t *c, const http_request_t *req, char *batch)
+{
+    pthread_mutex_lock(&cmdq.lock);
+    web_cmd_t *item = &cmdq.items[cmdq.tail % QUEUE_SIZE];
+    item->conn = c;
+    item->keep_alive = req->keep_alive;
+    item->batch = batch;
+    item->cmd_len = req->cmd_len;
+    memcpy(item->cmd, req->cmd, req->cmd_len + 1);
+    bool was_empty = cmdq.head == cmdq.tail;
+    cmdq.tail++;
+    pthread_mutex_unlock(&cmdq.lock);
+
+    if (was_empty)
+        ring(cmdq.doorbell[1]);
+}
+
+/* Queue the complete requests of a connection, answer it when nothing of it
+ * is left to run, and write what is ready.
+ */
+static void conn_serve(web_conn_t *c)
+{
+    while (!c->last && !c->bad && !c->closing &&
+           c->inflight < MAX_INFLIGHT &&
+           c->out_len - c->out_sent < OUT_LIMIT) {
+        http_request_t req;
+        int r = conn_parse(c, &req);
+        if (r < 0)
+            c->bad = true;
+        if (r <= 0)
+            break;
 
-        char *p = web_recv(web_connfd, &clientaddr);
-        char *buffer = "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\n\r\n";
-        web_send(web_connfd, buffer);
-        strncpy(buf, p, strlen(p) + 1);
-        free(p);
-        close(web_connfd);
-        return strlen(buf);
+        /* A POST carries a batch of commands in its body */
+        char *batch = NULL;
+        if (req.method_len == 4 && !memcmp(req.method, "POST", 4)) {
+            batch = malloc(req.content_length + 1);
+            if (!batch) {
+                c->bad = true;
+                break;
+            }
+            memcpy(batch, req.body, req.content_length);
+            batch[req.content_length] = '\0';
+        }
+        cmdq_push(c, &req, batch);
+        c->inflight++;
+        /* Whatever follows a request to close is ignored */
+        c->last = !req.keep_alive;
     }
 
-    FD_CLR(STDIN_FILENO, &listenset);
+    if (!c->inflight && !c->closing) {
+        if (c->bad) {
+            static const char msg[] = "Bad request\n";
+            conn_respond(c, "400 Bad Request", msg, sizeof(msg) - 1, true);
+        } else if (c->eof) {
+            c->closing = true;
+        }
+    }
+    conn_flush(c);
+}
+
+static void *web_worker_run(void *arg)
+{
+    web_worker_t *w = arg;
+
+    while (!atomic_load(&stopping)) {
+        uint32_t ids[MAX_EVENTS], revents[MAX_EVENTS];
+        int n = watch_wait(w, ids, revents);
+        if (n < 0 && errno != EINTR)
+            break;
+
+        for (int i = 0; i < n; i++) {
+            if (ids[i] == WATCH_SERVER) {
+                web_accept(w);
+            } else if (ids[i] == WATCH_WAKE) {
+                drain(w->wake[0]);
+                pthread_mutex_lock(&w->lock);
+                w->woken = false;
+                pthread_mutex_unlock(&w->lock);
+            } else if (revents[i] & (WATCH_IN | WATCH_ERR)) {
+                conn_read(&conns[ids[i]]);
+            }
+        }
+
+        /* Backwards, as serving may close and drop a connection */
+        pthread_mutex_lock(&w->lock);
+        for (int i = w->n_owned - 1; i >= 0; i--)
+            conn_serve(&conns[w->owned[i]]);
+        pthread_mutex_unlock(&w->lock);
+    }
+
+    /* Send what is left before the program ends */
+    pthread_mutex_lock(&w->lock);
+    while (w->n_owned) {
+        web_conn_t *c = &conns[w->owned[0]];
+        int flags = fcntl(c->fd, F_GETFL, 0);
+        fcntl(c->fd, F_SETFL, flags & ~O_NONBLOCK);
+        writen(c->fd, c->out + c->out_sent, c->out_len - c->out_sent);
+        conn_close(c);
+    }
+    pthread_mutex_unlock(&w->lock);
+    return NULL;
+}
+
+/* The rest runs in the interpreter thread */
+
+/* Hand the output of the command that just ran to its I/O thread */
+static void web_reply(web_conn_t *c,
+                      const char *data,
+                      size_t len,
+                      bool close_after)
+{
+    web_worker_t *w = c->worker;
+
+    pthread_mutex_lock(&w->lock);
+    conn_respond(c, "200 OK", data, len, close_after);
+    c->inflight--;
+    bool wake = !w->woken;
+    w->woken = true;
+    pthread_mutex_unlock(&w->lock);
+
+    if (wake)
+        ring(w->wake[1]);
+}
+
+/* The same for a batch, whose response goes out as each command finishes */
+static void web_reply_part(web_conn_t *c,
+                           bool start,
+                           const char *data,
+                           size_t len,
+                           bool end,
+                           bool close_after)
+{
+    web_worker_t *w = c->worker;
+
+    pthread_mutex_lock(&w->lock);
+    conn_stream(c, start, data, len, end);
+    if (end) {
+        c->inflight--;
+        if (close_after)
+            c->closing = true;
+    }
+    bool wake = !w->woken;
+    w->woken = true;
+    pthread_mutex_unlock(&w->lock);
+
+    if (wake)
+        ring(w->wake[1]);
+}
+
+static void web_finish(void)
+{
+    if (!active)
+        return;
+    if (batch) {
+        /* More commands of the batch may follow */
+        if (body_len)
+            web_reply_part(active, false, body, body_len, false, false);
+        body_len = 0;
+        return;
+    }
+    web_reply(active, body, body_len, active_close);
+    active = NULL;
+    web_connfd = 0;
+}
+
+static void web_batch_end(void)
+{
+    web_reply_part(active, false, NULL, 0, true, active_close);
+    free(batch);
+    batch = batch_next = NULL;
+    active = NULL;
+    web_connfd = 0;
+}
+
+/* Store the next command of the running batch in buf.  Blank lines are
+ * skipped and overlong ones cut like the command of a GET.
+ */
+static int web_batch_next(char *buf)
+{
+    while (batch_next && *batch_next) {
+        char *line = batch_next;
+        char *eol = strchr(line, '\n');
+        batch_next = eol ? eol + 1 : NULL;
+        size_t len = eol ? (size_t) (eol - line) : strlen(line);
+        if (len && line[len - 1] == '\r')
+            len--;
+        if (!len)
+            continue;
+
+        if (len > MAXLINE - 1)
+            len = MAXLINE - 1;
+        memcpy(buf, line, len);
+        buf[len] = '\0';
+        web_connfd = active->fd;
+        return len;
+    }
+    return 0;
+}
+
+static bool cmdq_pop(web_cmd_t *item)
+{
+    pthread_mutex_lock(&cmdq.lock);
+    bool ok = cmdq.head != cmdq.tail;
+    if (ok)
+        *item = cmdq.items[cmdq.head++ % QUEUE_SIZE];
+    pthread_mutex_unlock(&cmdq.lock);
+    return ok;
+}
+
+/* Store the next queued command in buf and make it the running one.  Return
+ * its length, 0 if the queue is empty.
+ */
+static int web_next_cmd(char *buf)
+{
+    if (batch) {
+        int len = web_batch_next(buf);
+        if (len)
+            return len;
+        web_batch_end();
+    }
+
+    web_cmd_t item;
+    while (cmdq_pop(&item)) {
+        if (item.batch) {
+            active = item.conn;
+            active_close = !item.keep_alive;
+            body_len = 0;
+            batch = batch_next = item.batch;
+            web_reply_part(active, true, NULL, 0, false, false);
+            int len = web_batch_next(buf);
+            if (len)
+                return len;
+            web_batch_end();
+            continue;
+        }
+        if (!*item.cmd) {
+            web_reply(item.conn, "", 0, !item.keep_alive);
+            continue;
+        }
+        size_t len = item.cmd_len;
+        if (len > MAXLINE - 1)
+            len = MAXLINE - 1;
+        memcpy(buf, item.cmd, len);
+        buf[len] = '\0';
+        active = item.conn;
+        active_close = !item.keep_alive;
+        body_len = 0;
+        web_connfd = item.conn->fd;
+        return len;
+    }
     return 0;
 }
+
+/* Wait until a web request or keyboard input is available.  Store the command
+ * of the request in buf and return its length, or return 0 when stdin is
+ * readable and no request is pending.
+ */
+int web_eventmux(char *buf)
+{
+    web_finish();
+
+    while (1) {
+        int len = web_next_cmd(buf);
+        if (len)
+            return len;
+
+        struct pollfd fds[2] = {
+            {.fd = STDIN_FILENO, .events = POLLIN},
+            {.fd = cmdq.doorbell[0], .events = POLLIN},
+        };
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+
+        if (fds[1].revents)
+            drain(cmdq.doorbell[0]);
+        if (fds[0].revents)
+            return web_next_cmd(buf);
+    }
+}
+
+/* Answer the command that ended the program, e.g. 'quit', and let the I/O
+ * threads send what is left.  A batch is answered up to that command.
+ */
+static void web_atexit(void)
+{
+    web_finish();
+    /* The rest of a batch is not run */
+    if (batch)
+        web_batch_end();
+    atomic_store(&stopping, true);
+    for (int i = 0; i < n_workers; i++)
+        ring(workers[i].wake[1]);
+    for (int i = 0; i < n_workers; i++)
+        pthread_join(workers[i].thread, NULL);
+}
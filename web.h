@@ -2,12 +2,34 @@
 #define TINYWEB_H
 
 #include <netinet/in.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
 
-int web_open(int port);
+/* A request parsed in place; the pointers refer into the parsed buffer */
+typedef struct {
+    const char *method; /* not NUL terminated */
+    size_t method_len;
+    char *cmd;             /* command taken from the URI, NUL terminated */
+    size_t cmd_len;
+    bool keep_alive;       /* the client wants to send more requests */
+    size_t content_length; /* bytes of body */
+    const char *body;
+    off_t offset; /* for support Range */
+    size_t end;   /* one past the last byte of the Range, 0 if unbounded */
+} http_request_t;
 
-char *web_recv(int fd, struct sockaddr_in *clientaddr);
+int web_open(int port, int threads);
 
-void web_send(int out_fd, char *buffer);
+/* Parse the request at the start of buf, decoding its URI in place.  Return
+ * the length of the request including its body, 0 if it is not complete yet
+ * or -1 if it is malformed.  When only the body is missing, 'body' and
+ * 'content_length' are already set, otherwise 'body' is NULL.  Nothing is
+ * allocated.
+ */
+ssize_t http_parse(char *buf, size_t len, http_request_t *req);
+
+void web_send(int out_fd, const char *buffer, size_t len);
 
 int web_eventmux(char *buf);
 